@@ -0,0 +1,142 @@
+#include "async-sender.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#include "metrics.h"
+
+AsyncSender::AsyncSender(int maxInFlight)
+    : multi_(curl_multi_init()), maxInFlight_(maxInFlight), inFlight_(0) {
+  if (!multi_) {
+    std::cerr << "Unable to create libcurl multi handle" << std::endl;
+    exit(1);
+  }
+  curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    static_cast<long>(maxInFlight));
+  curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+}
+
+AsyncSender::~AsyncSender() {
+  drain();
+  for (size_t i = 0; i < requests_.size(); ++i) {
+    cleanupUploadHandle(requests_[i]->handle);
+  }
+  curl_multi_cleanup(multi_);
+}
+
+void AsyncSender::post(const char *body, size_t size, Callback done) {
+  while (full()) {
+    poll(100);
+  }
+
+  Request *request;
+  if (idle_.empty()) {
+    requests_.push_back(std::unique_ptr<Request>(new Request));
+    request = requests_.back().get();
+    if (!initUploadHandle(request->handle)) {
+      std::cerr << "Unable to create libcurl handle" << std::endl;
+      exit(1);
+    }
+    curl_easy_setopt(request->handle.curl, CURLOPT_PRIVATE, request);
+  } else {
+    request = idle_.back();
+    idle_.pop_back();
+  }
+
+  request->body = body;
+  request->size = size;
+  request->attempts = 0;
+  request->done = done;
+  ++inFlight_;
+  metrics.adjust(GAUGE_IN_FLIGHT, 1);
+  start(request);
+}
+
+void AsyncSender::start(Request *request) {
+  prepareAddDataRequest(request->handle, request->body, request->size);
+  ++request->attempts;
+  curl_multi_add_handle(multi_, request->handle.curl);
+}
+
+void AsyncSender::finish(Request *request, CURLcode code) {
+  curl_multi_remove_handle(multi_, request->handle.curl);
+  recordAttempt(request->handle, code);
+  const bool failed = requestFailed(request->handle, code);
+  if (failed && shouldRetry(request->handle, code, request->attempts)) {
+    metrics.add(COUNTER_RETRIES);
+    request->retryAt =
+        std::chrono::steady_clock::now() + retryDelay(request->attempts);
+    retrying_.push_back(request);
+    return;
+  }
+
+  UploadResult result;
+  result.curlCode = code;
+  result.attempts = request->attempts;
+  curl_easy_getinfo(request->handle.curl, CURLINFO_RESPONSE_CODE,
+                    &result.responseCode);
+  if (!failed) {
+    getJobUri(request->handle, result.jobUri);
+  }
+
+  // Return the handle to the pool before the callback so the callback may
+  // post again.
+  Callback done;
+  done.swap(request->done);
+  idle_.push_back(request);
+  --inFlight_;
+  metrics.adjust(GAUGE_IN_FLIGHT, -1);
+  done(result);
+}
+
+int AsyncSender::startDueRetries(int timeoutMs) {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  int waitMs = timeoutMs;
+  for (size_t i = 0; i < retrying_.size();) {
+    Request *request = retrying_[i];
+    if (request->retryAt <= now) {
+      retrying_.erase(retrying_.begin() + i);
+      // start() clears the failed attempt's response and headers
+      start(request);
+      continue;
+    }
+    waitMs = std::min<int>(
+        waitMs, std::chrono::duration_cast<std::chrono::milliseconds>(
+                    request->retryAt - now)
+                        .count() +
+                    1);
+    ++i;
+  }
+  return waitMs;
+}
+
+void AsyncSender::poll(int timeoutMs) {
+  timeoutMs = startDueRetries(timeoutMs);
+  int running = 0;
+  curl_multi_perform(multi_, &running);
+
+  int queued = 0;
+  bool finished = false;
+  while (CURLMsg *message = curl_multi_info_read(multi_, &queued)) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    Request *request = NULL;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &request);
+    finish(request, message->data.result);
+    finished = true;
+  }
+
+  // With only retries outstanding this just sleeps until the next is due
+  if (!finished && (running > 0 || !retrying_.empty())) {
+    curl_multi_poll(multi_, NULL, 0, timeoutMs, NULL);
+  }
+}
+
+void AsyncSender::drain() {
+  while (inFlight_ > 0) {
+    poll(100);
+  }
+}
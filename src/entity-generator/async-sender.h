@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "upload.h"
+
+// The outcome of one add-data POST.
+struct UploadResult {
+  CURLcode curlCode = CURLE_OK;
+  long responseCode = 0;
+  // Number of times the request was sent, including retries
+  int attempts = 0;
+  // The asynchronous job's Location; empty if the response had none
+  std::string jobUri;
+};
+
+// Sends add-data POSTs over a curl_multi handle, keeping up to maxInFlight of
+// them in flight at once.  Easy handles are pooled and share the multi
+// handle's connection cache, so connections are reused between requests.
+//
+// A POST answered with a 5xx waits out its backoff (retryDelay()) off the
+// multi handle, and is added back by poll() once it is due.
+//
+// An AsyncSender is driven by the thread that owns it: callbacks run from
+// within post(), poll() and drain() on that thread.
+class AsyncSender {
+public:
+  typedef std::function<void(const UploadResult &)> Callback;
+
+  explicit AsyncSender(int maxInFlight);
+  ~AsyncSender();
+
+  size_t inFlight() const { return inFlight_; }
+  bool full() const { return inFlight_ >= maxInFlight_; }
+
+  // Starts a POST of size bytes of body; done is called once it completes.
+  // body is not copied and must stay valid until then.  If maxInFlight
+  // requests are already outstanding this drives them until one finishes.
+  void post(const char *body, size_t size, Callback done);
+
+  // Drives outstanding transfers, waiting up to timeoutMs for activity, and
+  // runs the callbacks of any that finished.
+  void poll(int timeoutMs);
+
+  // Blocks until every outstanding request has finished.
+  void drain();
+
+private:
+  struct Request {
+    UploadHandle handle;
+    const char *body = NULL;
+    size_t size = 0;
+    int attempts = 0;
+    Callback done;
+    // When a request waiting to be retried is due
+    std::chrono::steady_clock::time_point retryAt;
+  };
+
+  void start(Request *request);
+  void finish(Request *request, CURLcode code);
+  // Starts the retries that are due and returns how long until the next
+  // one, at most timeoutMs
+  int startDueRetries(int timeoutMs);
+
+  CURLM *multi_;
+  size_t maxInFlight_;
+  size_t inFlight_;
+  std::vector<std::unique_ptr<Request>> requests_;
+  std::vector<Request *> idle_;
+  // Requests backing off before a retry
+  std::vector<Request *> retrying_;
+};
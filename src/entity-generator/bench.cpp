@@ -0,0 +1,545 @@
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+#include "compress.h"
+#include "entity.h"
+#include "pacing.h"
+#include "serialize.h"
+#include "upload.h"
+#include "walk-kernel.h"
+
+namespace po = boost::program_options;
+
+// Set by --format=json
+bool jsonOutput = false;
+
+// One line of results: the benchmark's name and its fields, printed as
+// "name key=value ..." or, with --format=json, as a JSON object with the name
+// under "benchmark".  The line is printed when the Result goes out of scope.
+class Result {
+public:
+  explicit Result(const char *benchmark) : writer_(json_) {
+    text_ << benchmark;
+    writer_.StartObject();
+    writer_.Key("benchmark");
+    writer_.String(benchmark);
+  }
+
+  ~Result() {
+    writer_.EndObject();
+    if (jsonOutput) {
+      std::cout << json_.GetString() << std::endl;
+    } else {
+      std::cout << text_.str() << std::endl;
+    }
+  }
+
+  Result &add(const char *key, const char *value) {
+    text_ << " " << key << "=" << value;
+    writer_.Key(key);
+    writer_.String(value);
+    return *this;
+  }
+  Result &add(const char *key, const std::string &value) {
+    return add(key, value.c_str());
+  }
+  Result &add(const char *key, bool value) {
+    text_ << " " << key << "=" << (value ? "yes" : "no");
+    writer_.Key(key);
+    writer_.Bool(value);
+    return *this;
+  }
+  Result &add(const char *key, double value) {
+    text_ << " " << key << "=" << value;
+    writer_.Key(key);
+    writer_.Double(value);
+    return *this;
+  }
+  Result &add(const char *key, int value) {
+    return add(key, static_cast<long long>(value));
+  }
+  Result &add(const char *key, long value) {
+    return add(key, static_cast<long long>(value));
+  }
+  Result &add(const char *key, size_t value) {
+    text_ << " " << key << "=" << value;
+    writer_.Key(key);
+    writer_.Uint64(value);
+    return *this;
+  }
+  Result &add(const char *key, long long value) {
+    text_ << " " << key << "=" << value;
+    writer_.Key(key);
+    writer_.Int64(value);
+    return *this;
+  }
+
+private:
+  std::ostringstream text_;
+  rapidjson::StringBuffer json_;
+  rapidjson::Writer<rapidjson::StringBuffer> writer_;
+};
+
+// The array-of-structs layout entities had before EntityStore, kept so the
+// two layouts can be compared.
+struct LegacyEntity {
+  std::string id;
+  std::string kind;
+  std::array<double, 3> location;
+  std::array<double, 3> initialLocation;
+  uint64_t timestamp;
+};
+
+// Returns the mean wall time in milliseconds of calling run, after one
+// untimed warm-up call.
+template <typename Function> double timeMs(int iterations, Function run) {
+  run();
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    run();
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+void initializeLegacyEntities(std::vector<LegacyEntity> &legacy) {
+  legacy.clear();
+  for (size_t i = 0; i < entities.size(); ++i) {
+    LegacyEntity entity;
+    entity.id = str(boost::format("live-test-%1%") % i);
+    entity.kind = entities.kinds[entities.kindIndex[i]];
+    entity.location = {
+        {entities.longitude[i], entities.latitude[i], entities.altitude[i]}};
+    entity.initialLocation = {
+        {entities.initialLongitude[i], entities.initialLatitude[i], 0.}};
+    entity.timestamp = entities.timestamp[i];
+    legacy.push_back(entity);
+  }
+}
+
+// The per-tick update as it was written against std::vector<Entity>
+void stepLegacyEntities(std::vector<LegacyEntity> &legacy,
+                        random_generator &walk) {
+  for (std::vector<LegacyEntity>::iterator topo = legacy.begin();
+       topo != legacy.end(); ++topo) {
+    double lng = topo->location[0];
+    double lat = topo->location[1];
+    double newLat = lat + walk();
+    double newLng = lng + walk();
+    if (lng > -180 && newLng < -180) {
+      newLng += 360;
+    } else if (lng < 180 and newLng > 180) {
+      newLng -= 360;
+    }
+    if (lat > -90 && newLat < -90) {
+      newLat += 180;
+    } else if (lat < 90 and newLat > 90) {
+      newLat -= 180;
+    }
+    topo->location[0] = newLng;
+    topo->location[1] = newLat;
+    topo->timestamp += timeIntervalMs();
+  }
+}
+
+// Heap bytes owned by s; short strings live inside the object itself
+size_t heapBytes(const std::string &s) {
+  const char *object = reinterpret_cast<const char *>(&s);
+  if (s.data() >= object && s.data() < object + sizeof(s)) {
+    return 0;
+  }
+  return s.capacity() + 1;
+}
+
+size_t legacyBytesPerEntity(const std::vector<LegacyEntity> &legacy) {
+  size_t bytes = legacy.size() * sizeof(LegacyEntity);
+  for (size_t i = 0; i < legacy.size(); ++i) {
+    bytes += heapBytes(legacy[i].id) + heapBytes(legacy[i].kind);
+  }
+  return legacy.empty() ? 0 : bytes / legacy.size();
+}
+
+// Whether entities are where expected left them, bit for bit
+bool samePositions(const EntityStore &expected) {
+  const size_t bytes = expected.size() * sizeof(double);
+  return entities.size() == expected.size() &&
+         memcmp(entities.longitude.data(), expected.longitude.data(),
+                bytes) == 0 &&
+         memcmp(entities.latitude.data(), expected.latitude.data(), bytes) ==
+             0;
+}
+
+bool sameLocations(const std::vector<LegacyEntity> &legacy) {
+  for (size_t i = 0; i < legacy.size(); ++i) {
+    if (legacy[i].location[0] != entities.longitude[i] ||
+        legacy[i].location[1] != entities.latitude[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Response headers as an add-data POST gets them, one callback per line
+const char *ADD_DATA_RESPONSE_HEADERS[] = {
+    "HTTP/1.1 202 Accepted\r\n",
+    "Date: Mon, 01 Jan 2024 12:00:00 GMT\r\n",
+    "Content-Type: application/json\r\n",
+    "Content-Length: 0\r\n",
+    "Connection: keep-alive\r\n",
+    "Location: /conduce/api/v1/jobs/4f1c2d3e-0a9b-4c8d-8e7f-6a5b4c3d2e1f\r\n",
+    "Strict-Transport-Security: max-age=31536000\r\n",
+    "\r\n"};
+
+const char *JOB_STATUS_RUNNING = "{\"progress\":0.5}";
+const char *JOB_STATUS_FINISHED =
+    "{\"progress\":1.0,\"response\":200,\"result\":\"\"}";
+
+// A Location some servers give instead of a path; its colons are part of the
+// value
+const char *ABSOLUTE_LOCATION_HEADER =
+    "Location: http://localhost:8080/conduce/api/v1/jobs/7\r\n";
+const char *ABSOLUTE_LOCATION = "http://localhost:8080/conduce/api/v1/jobs/7";
+
+// Ticks the seek benchmark covers; it seeks through the first half
+const int SEEK_TICKS = 64;
+
+// Times headerfunc over a whole add-data response, per header line.  Returns
+// false if an absolute Location does not come through whole.
+bool benchmarkHeaders(int iterations) {
+  const size_t lines = sizeof(ADD_DATA_RESPONSE_HEADERS) /
+                       sizeof(ADD_DATA_RESPONSE_HEADERS[0]);
+  const int responses = 10000;
+  std::map<std::string, std::string> headers;
+  double ms = timeMs(iterations, [&headers, lines, responses]() {
+    for (int r = 0; r < responses; ++r) {
+      headers.clear();
+      for (size_t i = 0; i < lines; ++i) {
+        headerfunc(const_cast<char *>(ADD_DATA_RESPONSE_HEADERS[i]), 1,
+                   strlen(ADD_DATA_RESPONSE_HEADERS[i]), &headers);
+      }
+    }
+  });
+  const bool locationFound = headers.count("Location") == 1;
+
+  headers.clear();
+  headerfunc(const_cast<char *>(ABSOLUTE_LOCATION_HEADER), 1,
+             strlen(ABSOLUTE_LOCATION_HEADER), &headers);
+  const bool absolute = headers["Location"] == ABSOLUTE_LOCATION &&
+                        getJobUrl(headers["Location"]) == ABSOLUTE_LOCATION;
+  Result("headers")
+      .add("lines", lines)
+      .add("ns_per_line", ms * 1e6 / (responses * lines))
+      .add("ns_per_response", ms * 1e6 / responses)
+      .add("location_found", locationFound)
+      .add("absolute_location", absolute);
+  return locationFound && absolute;
+}
+
+// Times parseJobStatus on the bodies of an unfinished and a finished job
+void benchmarkJobStatus(int iterations) {
+  const char *bodies[] = {JOB_STATUS_RUNNING, JOB_STATUS_FINISHED};
+  const char *states[] = {"running", "finished"};
+  const int parses = 100000;
+  for (size_t b = 0; b < sizeof(bodies) / sizeof(bodies[0]); ++b) {
+    const char *body = bodies[b];
+    bool finished = false;
+    double ms = timeMs(iterations, [body, parses, &finished]() {
+      long response;
+      std::string result;
+      for (int p = 0; p < parses; ++p) {
+        finished = parseJobStatus(body, response, result);
+      }
+    });
+    Result("job_status")
+        .add("state", states[b])
+        .add("ns_per_parse", ms * 1e6 / parses)
+        .add("finished", finished);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<int> entityCounts;
+  int iterations = 5;
+  std::vector<int> threadCounts;
+  std::string format;
+
+  po::options_description desc(
+      "entity-generator-bench measures the entity-generator hot paths."
+      "\n\nConfiguration options");
+  desc.add_options()("help", "Print the list of command line options")(
+      "entity-count",
+      po::value<std::vector<int>>(&entityCounts)
+          ->multitoken()
+          ->default_value(std::vector<int>{1000, 100000, 1000000},
+                          "1000 100000 1000000"),
+      "Entity counts to benchmark")(
+      "iterations", po::value<int>(&iterations)->default_value(5),
+      "Timed iterations per benchmark")(
+      "threads",
+      po::value<std::vector<int>>(&threadCounts)
+          ->multitoken()
+          ->default_value(std::vector<int>{1, 2, 4}, "1 2 4"),
+      "Thread counts for the --rng=stream and --rng=philox step "
+      "benchmarks")(
+      "format", po::value<std::string>(&format)->default_value("text"),
+      "Output format: text (one \"name key=value ...\" line per result) or "
+      "json (one JSON object per line)");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+  if (format != "text" && format != "json") {
+    std::cerr << "Unknown format: " << format << std::endl;
+    std::cerr << "entity-generator-bench --format=text|json" << std::endl;
+    return 1;
+  }
+  jsonOutput = format == "json";
+
+  options.kind = "default";
+  options.rng = "mt19937";
+  options.simd = "auto";
+  boost::random::uniform_real_distribution<> walk_range(-1 * options.stepSize,
+                                                        options.stepSize);
+
+  if (!benchmarkHeaders(iterations)) {
+    return 1;
+  }
+  benchmarkJobStatus(iterations);
+
+  for (size_t c = 0; c < entityCounts.size(); ++c) {
+    options.entityCount = entityCounts[c];
+    entities = EntityStore();
+    for (size_t t = 0; t < threadCounts.size(); ++t) {
+      options.threads = threadCounts[t];
+      options.rng = "philox";
+      double philoxMs = timeMs(iterations, []() { initializeEntities(); });
+      options.rng = "mt19937";
+      Result("init")
+          .add("entities", options.entityCount)
+          .add("rng", "philox")
+          .add("threads", options.threads)
+          .add("ms", philoxMs);
+    }
+    options.threads = 1;
+    double initMs = timeMs(iterations, []() { initializeEntities(); });
+    Result("init")
+        .add("entities", options.entityCount)
+        .add("rng", "mt19937")
+        .add("threads", 1)
+        .add("ms", initMs)
+        .add("peak_rss_kb", peakRssKb());
+
+    // Array of structs against EntityStore, both driven by the shared
+    // mt19937 walk from the same seed
+    std::vector<LegacyEntity> legacy;
+    initializeLegacyEntities(legacy);
+    boost::mt19937 legacyAlg(0);
+    random_generator legacyWalk(legacyAlg, walk_range);
+    boost::mt19937 alg_walk(0);
+    random_generator walk(alg_walk, walk_range);
+    double aosMs = timeMs(iterations, [&legacy, &legacyWalk]() {
+      stepLegacyEntities(legacy, legacyWalk);
+    });
+    double soaMs = timeMs(iterations, [&walk]() { stepEntities(walk); });
+    bool sameSteps = sameLocations(legacy);
+    Result("layout")
+        .add("entities", options.entityCount)
+        .add("aos_step_ms", aosMs)
+        .add("soa_step_ms", soaMs)
+        .add("aos_bytes_per_entity", legacyBytesPerEntity(legacy))
+        .add("soa_bytes_per_entity", EntityStore::bytesPerEntity())
+        .add("identical", sameSteps);
+    if (!sameSteps) {
+      return 1;
+    }
+    legacy.clear();
+
+    PayloadBuffer domBuffer;
+    PayloadBuffer saxBuffer;
+    double domMs = timeMs(iterations, [&domBuffer]() {
+      serializeEntitiesDom(entities, domBuffer);
+    });
+    double saxMs = timeMs(
+        iterations, [&saxBuffer]() { serializeEntities(entities, saxBuffer); });
+
+    bool identical = domBuffer.size() == saxBuffer.size() &&
+                     memcmp(domBuffer.data(), saxBuffer.data(),
+                            saxBuffer.size()) == 0;
+
+    Result("serialize")
+        .add("entities", options.entityCount)
+        .add("bytes", saxBuffer.size())
+        .add("dom_ms", domMs)
+        .add("sax_ms", saxMs)
+        .add("speedup", domMs / saxMs)
+        .add("identical", identical);
+    if (!identical) {
+      return 1;
+    }
+
+    // Streaming compression on top of the SAX serializer
+    const char *codecs[] = {"deflate", "gzip", "zstd"};
+    const int levels[] = {1, 6, 9};
+    for (size_t k = 0; k < sizeof(codecs) / sizeof(codecs[0]); ++k) {
+      if (!PayloadCompressor::supported(codecs[k])) {
+        continue;
+      }
+      for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l) {
+        PayloadBuffer compressed;
+        compressed.compressor.reset(
+            new PayloadCompressor(codecs[k], levels[l]));
+        double compressMs = timeMs(iterations, [&compressed]() {
+          serializeEntities(entities, compressed);
+        });
+        Result("compress")
+            .add("entities", options.entityCount)
+            .add("codec", codecs[k])
+            .add("level", levels[l])
+            .add("bytes", compressed.size())
+            .add("ratio",
+                 static_cast<double>(compressed.jsonSize) / compressed.size())
+            .add("ms", compressMs)
+            .add("extra_ms", compressMs - saxMs);
+      }
+    }
+
+    // The per-entity sources, across thread counts and walk kernels
+    const char *sources[] = {"stream", "philox"};
+    for (size_t r = 0; r < sizeof(sources) / sizeof(sources[0]); ++r) {
+      options.rng = sources[r];
+      // Scaling is against a real single-threaded step, whose positions
+      // every thread count must reproduce from the same starting state
+      options.threads = 1;
+      const EntityStore unstepped = entities;
+      double singleMs = timeMs(iterations, [&walk]() { stepEntities(walk); });
+      entities = unstepped;
+      stepEntities(walk);
+      const EntityStore single = entities;
+      for (size_t t = 0; t < threadCounts.size(); ++t) {
+        options.threads = threadCounts[t];
+        double stepMs =
+            timeMs(iterations, [&walk]() { stepEntities(walk); });
+        entities = unstepped;
+        stepEntities(walk);
+        bool identical = samePositions(single);
+        Result("step")
+            .add("entities", options.entityCount)
+            .add("rng", options.rng)
+            .add("threads", options.threads)
+            .add("ms", stepMs)
+            .add("scaling", singleMs / stepMs)
+            .add("identical", identical);
+        if (!identical) {
+          return 1;
+        }
+      }
+      options.threads = 1;
+
+      // Every kernel steps the same starting state once, for comparison
+      // with the scalar kernel, which is always available and goes first
+      const EntityStore start = entities;
+      EntityStore scalar;
+      const char *kernels[] = {"scalar", "sse2", "avx2"};
+      for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        WalkKernel kernel;
+        if (!parseWalkKernel(kernels[k], kernel)) {
+          continue;
+        }
+        options.simd = kernels[k];
+        double stepMs =
+            timeMs(iterations, [&walk]() { stepEntities(walk); });
+        entities = start;
+        stepEntities(walk);
+        if (k == 0) {
+          scalar = entities;
+        }
+        bool identical = samePositions(scalar);
+        Result("walk")
+            .add("entities", options.entityCount)
+            .add("rng", options.rng)
+            .add("simd", kernels[k])
+            .add("ms", stepMs)
+            .add("identical", identical);
+        if (!identical) {
+          return 1;
+        }
+      }
+      options.simd = "auto";
+    }
+    options.rng = "mt19937";
+
+    // Seeking half way and stepping the rest must leave the entities where
+    // stepping all the way does, under every source
+    const char *seekSources[] = {"mt19937", "stream", "philox"};
+    for (size_t r = 0; r < sizeof(seekSources) / sizeof(seekSources[0]);
+         ++r) {
+      options.rng = seekSources[r];
+      initializeEntities();
+      const EntityStore start = entities;
+      double stepMs = timeMs(iterations, [&start, &walk_range]() {
+        entities = start;
+        boost::mt19937 alg(0);
+        random_generator stepWalk(alg, walk_range);
+        for (int t = 0; t < SEEK_TICKS; ++t) {
+          stepEntities(stepWalk);
+        }
+      });
+      const EntityStore stepped = entities;
+      double seekMs = timeMs(iterations, [&start, &walk_range]() {
+        entities = start;
+        boost::mt19937 alg(0);
+        random_generator seekWalk(alg, walk_range);
+        seekEntities(seekWalk, SEEK_TICKS / 2);
+        for (int t = SEEK_TICKS / 2; t < SEEK_TICKS; ++t) {
+          stepEntities(seekWalk);
+        }
+      });
+      bool identical = samePositions(stepped) &&
+                       entities.timestamp == stepped.timestamp &&
+                       entities.ticks == stepped.ticks;
+      Result("seek")
+          .add("entities", options.entityCount)
+          .add("rng", options.rng)
+          .add("ticks", SEEK_TICKS)
+          .add("step_ms", stepMs)
+          .add("seek_ms", seekMs)
+          .add("identical", identical);
+      if (!identical) {
+        return 1;
+      }
+    }
+    options.rng = "mt19937";
+
+    // The test pattern cycles each entity round a square about its grid
+    // location instead of drawing a random walk
+    options.testPattern = true;
+    initializeEntities();
+    double patternMs = timeMs(iterations, [&walk]() { stepEntities(walk); });
+    Result("test_pattern_step")
+        .add("entities", options.entityCount)
+        .add("ms", patternMs);
+    options.testPattern = false;
+  }
+
+  return 0;
+}
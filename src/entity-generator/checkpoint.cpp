@@ -0,0 +1,339 @@
+#include "checkpoint.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "entity.h"
+#include "log.h"
+#include "worker-pool.h"
+
+namespace {
+
+const char CHECKPOINT_MAGIC[8] = {'E', 'G', 'C', 'K', 'P', 'T', 0, 1};
+const int64_t NO_SLOT = -1;
+
+struct CheckpointHeader {
+  char magic[8];
+  // The run the checkpoints belong to
+  uint64_t entityCount;
+  uint64_t seed;
+  char rng[16];
+  uint64_t slotSize;
+  // The slot holding the last complete checkpoint, or NO_SLOT
+  int64_t activeSlot;
+};
+
+struct SlotHeader {
+  // Ticks stepped when the checkpoint was taken
+  uint64_t ticks;
+  // Length of the mt19937 walk generator's state, as text, which follows
+  uint64_t walkLength;
+};
+
+// Offsets within the file are page aligned so slots can be flushed on their
+// own
+const size_t CHECKPOINT_PAGE_SIZE = 4096;
+const size_t HEADER_SIZE = CHECKPOINT_PAGE_SIZE;
+// Room for a SlotHeader and the walk generator's state (about 7 KB)
+const size_t SLOT_HEADER_SIZE = 4 * CHECKPOINT_PAGE_SIZE;
+const size_t FIELD_ALIGNMENT = 64;
+
+size_t roundUp(size_t bytes, size_t alignment) {
+  return (bytes + alignment - 1) / alignment * alignment;
+}
+
+// Calls visit(data, bytes, changes) for every array of store that is saved,
+// in the order they are laid out in a slot, for count entities.  changes is
+// false for the fields that stay as initializeEntities() left them; the walk
+// streams only advance under --rng=stream.
+template <typename Visit>
+void forEachField(EntityStore &store, size_t count, Visit visit) {
+  visit(store.longitude.data(), count * sizeof(double), true);
+  visit(store.latitude.data(), count * sizeof(double), true);
+  visit(store.timestamp.data(), count * sizeof(uint64_t), true);
+  visit(store.walkState.data(), count * sizeof(uint64_t),
+        options.rng == "stream");
+  visit(store.altitude.data(), count * sizeof(double), false);
+  visit(store.initialLongitude.data(), count * sizeof(double), false);
+  visit(store.initialLatitude.data(), count * sizeof(double), false);
+  visit(store.kindIndex.data(), count * sizeof(uint16_t), false);
+}
+
+size_t slotSizeFor(size_t count) {
+  // Only the sizes are needed, so an empty store stands in for the real one
+  EntityStore empty;
+  size_t size = SLOT_HEADER_SIZE;
+  forEachField(empty, count, [&size](void *, size_t bytes, bool) {
+    size += roundUp(bytes, FIELD_ALIGNMENT);
+  });
+  return roundUp(size, CHECKPOINT_PAGE_SIZE);
+}
+
+CheckpointHeader *header(char *map) {
+  return reinterpret_cast<CheckpointHeader *>(map);
+}
+
+double toMs(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+} // namespace
+
+Checkpointer::Checkpointer()
+    : fd_(-1), map_(NULL), mapSize_(0), slotSize_(0), resumable_(false),
+      staticStaged_(false), pending_(-1), pendingTicks_(0), stopping_(false),
+      taken_(0), deferred_(0), totalPause_(0), maxPause_(0) {}
+
+Checkpointer::~Checkpointer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    wake_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (map_) {
+    munmap(map_, mapSize_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool Checkpointer::open() {
+  path_ = options.checkpoint;
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    LOG(LOG_ERROR) << "Unable to open " << path_ << ": " << strerror(errno);
+    return false;
+  }
+  slotSize_ = slotSizeFor(options.entityCount);
+  mapSize_ = HEADER_SIZE + 2 * slotSize_;
+
+  struct stat info;
+  if (fstat(fd_, &info) != 0) {
+    LOG(LOG_ERROR) << "Unable to stat " << path_ << ": " << strerror(errno);
+    return false;
+  }
+  CheckpointHeader existing;
+  if (options.resume &&
+      pread(fd_, &existing, sizeof(existing), 0) ==
+          static_cast<ssize_t>(sizeof(existing)) &&
+      memcmp(existing.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) ==
+          0) {
+    existing.rng[sizeof(existing.rng) - 1] = '\0';
+    if (existing.entityCount != static_cast<uint64_t>(options.entityCount) ||
+        existing.seed != options.seed || options.rng != existing.rng) {
+      LOG(LOG_ERROR) << path_ << " was checkpointed with --entity-count="
+                     << existing.entityCount << " --rng=" << existing.rng
+                     << " --seed=" << existing.seed
+                     << "; resume with the same options";
+      return false;
+    }
+    resumable_ = existing.activeSlot != NO_SLOT &&
+                 existing.slotSize == slotSize_ &&
+                 static_cast<uint64_t>(info.st_size) == mapSize_;
+  }
+
+  if (!resumable_) {
+    if (options.resume) {
+      LOG(LOG_INFO) << "No checkpoint to resume from in " << path_
+                    << "; starting from the beginning";
+    }
+    // Allocating every block up front means running out of space shows up
+    // here rather than as a SIGBUS on a store into the mapping
+    int error = 0;
+    if (ftruncate(fd_, 0) != 0 || ftruncate(fd_, mapSize_) != 0) {
+      error = errno;
+    } else {
+      error = posix_fallocate(fd_, 0, mapSize_);
+    }
+    if (error != 0) {
+      LOG(LOG_ERROR) << "Unable to size " << path_ << ": " << strerror(error);
+      return false;
+    }
+  }
+
+  void *mapped =
+      mmap(NULL, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapped == MAP_FAILED) {
+    LOG(LOG_ERROR) << "Unable to map " << path_ << ": " << strerror(errno);
+    return false;
+  }
+  map_ = static_cast<char *>(mapped);
+
+  if (!resumable_) {
+    CheckpointHeader *fresh = header(map_);
+    memcpy(fresh->magic, CHECKPOINT_MAGIC, sizeof(fresh->magic));
+    fresh->entityCount = options.entityCount;
+    fresh->seed = options.seed;
+    strncpy(fresh->rng, options.rng.c_str(), sizeof(fresh->rng) - 1);
+    fresh->slotSize = slotSize_;
+    fresh->activeSlot = NO_SLOT;
+    msync(map_, HEADER_SIZE, MS_SYNC);
+  }
+
+  // Sized, and so faulted in, now rather than during the first checkpoint
+  staging_.resize(slotSize_);
+
+  nextDue_ = Clock::now() +
+             std::chrono::duration_cast<Clock::duration>(
+                 std::chrono::duration<double>(options.checkpointInterval));
+  thread_ = std::thread(&Checkpointer::run, this);
+  return true;
+}
+
+bool Checkpointer::restore(random_generator &walk) {
+  const int64_t active = header(map_)->activeSlot;
+  if (active != 0 && active != 1) {
+    LOG(LOG_ERROR) << path_ << " names no valid slot";
+    return false;
+  }
+  const char *source = slot(active);
+  const SlotHeader *saved = reinterpret_cast<const SlotHeader *>(source);
+  if (saved->walkLength > SLOT_HEADER_SIZE - sizeof(SlotHeader)) {
+    LOG(LOG_ERROR) << path_ << " has a corrupt checkpoint";
+    return false;
+  }
+
+  entities.kinds.assign(1, options.kind);
+  entities.resize(options.entityCount);
+  entities.ticks = saved->ticks;
+  std::istringstream walkState(
+      std::string(source + sizeof(SlotHeader), saved->walkLength));
+  walkState >> walk.engine();
+
+  size_t offset = SLOT_HEADER_SIZE;
+  forEachField(entities, entities.size(),
+               [source, &offset](void *data, size_t bytes, bool) {
+                 memcpy(data, source + offset, bytes);
+                 offset += roundUp(bytes, FIELD_ALIGNMENT);
+               });
+  LOG(LOG_INFO) << "Resuming " << entities.size() << " entities from tick "
+                << entities.ticks << " (" << path_ << ")";
+  return true;
+}
+
+void Checkpointer::tickAcknowledged(random_generator &walk, bool force) {
+  Clock::time_point start = Clock::now();
+  if (!force && start < nextDue_) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (pending_ >= 0) {
+    if (!force) {
+      ++deferred_;
+      return;
+    }
+    idle_.wait(lock, [this] { return pending_ < 0; });
+    start = Clock::now();
+  }
+
+  const int64_t active = header(map_)->activeSlot;
+  const int target = active == 0 ? 1 : 0;
+  char *destination = &staging_[0];
+
+  std::ostringstream walkState;
+  walkState << walk.engine();
+  const std::string state = walkState.str();
+  if (sizeof(SlotHeader) + state.size() > SLOT_HEADER_SIZE) {
+    LOG(LOG_ERROR) << "The walk generator's state does not fit in a "
+                   << "checkpoint";
+    return;
+  }
+  SlotHeader *saved = reinterpret_cast<SlotHeader *>(destination);
+  saved->ticks = entities.ticks;
+  saved->walkLength = state.size();
+  memcpy(destination + sizeof(SlotHeader), state.data(), state.size());
+
+  // Each of the --threads threads copies its own range of entities out of
+  // every field, so the pause shrinks with the thread count
+  const bool copyStatic = !staticStaged_;
+  const size_t count = entities.size();
+  workerPool().run(count, [destination, copyStatic, count](size_t begin,
+                                                           size_t end) {
+    size_t offset = SLOT_HEADER_SIZE;
+    forEachField(entities, count,
+                 [destination, &offset, copyStatic, count, begin,
+                  end](void *data, size_t bytes, bool changes) {
+                   if (changes || copyStatic) {
+                     const size_t size = bytes / count;
+                     memcpy(destination + offset + begin * size,
+                            static_cast<char *>(data) + begin * size,
+                            (end - begin) * size);
+                   }
+                   offset += roundUp(bytes, FIELD_ALIGNMENT);
+                 });
+  });
+  staticStaged_ = true;
+
+  pending_ = target;
+  pendingTicks_ = entities.ticks;
+  wake_.notify_all();
+
+  Clock::time_point end = Clock::now();
+  Clock::duration pause = end - start;
+  ++taken_;
+  totalPause_ += pause;
+  if (pause > maxPause_) {
+    maxPause_ = pause;
+  }
+  nextDue_ = end + std::chrono::duration_cast<Clock::duration>(
+                       std::chrono::duration<double>(
+                           options.checkpointInterval));
+}
+
+void Checkpointer::finish() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return pending_ < 0; });
+}
+
+void Checkpointer::report() const {
+  LOG(LOG_INFO) << "Checkpoints: " << taken_ << " taken, " << deferred_
+                << " deferred behind a flush; loop paused "
+                << (taken_ ? toMs(totalPause_) / taken_ : 0)
+                << " ms on average, " << toMs(maxPause_) << " ms at most";
+}
+
+void Checkpointer::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] { return pending_ >= 0 || stopping_; });
+    if (pending_ < 0) {
+      return;
+    }
+    const int target = pending_;
+    const uint64_t ticks = pendingTicks_;
+    lock.unlock();
+
+    // The slot has to be on disk before the header names it
+    memcpy(slot(target), &staging_[0], slotSize_);
+    bool ok = msync(slot(target), slotSize_, MS_SYNC) == 0;
+    if (ok) {
+      header(map_)->activeSlot = target;
+      ok = msync(map_, HEADER_SIZE, MS_SYNC) == 0;
+    }
+    if (ok) {
+      LOG(LOG_DEBUG) << "Checkpointed tick " << ticks << " to slot "
+                     << (target == 0 ? "A" : "B");
+    } else {
+      LOG(LOG_ERROR) << "Unable to flush checkpoint to " << path_ << ": "
+                     << strerror(errno);
+    }
+
+    lock.lock();
+    pending_ = -1;
+    idle_.notify_all();
+  }
+}
+
+char *Checkpointer::slot(int index) const {
+  return map_ + HEADER_SIZE + index * slotSize_;
+}
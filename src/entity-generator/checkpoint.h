@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rng.h"
+
+// Saves the simulation state every --checkpoint-interval seconds to a
+// memory-mapped file, so --resume can carry on from the last tick whose jobs
+// had all finished instead of starting over.
+//
+// The file holds a header page and two slots, A and B, each big enough for
+// every entity.  A checkpoint is written to the slot not named by the header,
+// which is flushed to disk before the header is pointed at it, so a crash
+// mid-checkpoint leaves the previous one intact.
+//
+// The generation loop only copies the state into a staging image of a slot
+// in ordinary memory, split across the --threads threads; the fields that
+// never change after initialization are staged once.  A background thread
+// copies the image into the mapping and flushes it, so the loop never takes
+// the page faults of writing to a file mapping.  A checkpoint that falls due
+// while the previous one is still being written waits for a later tick.
+class Checkpointer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  Checkpointer();
+  ~Checkpointer();
+
+  // Opens --checkpoint, creating it if needed.  With --resume, an existing
+  // checkpoint made with the same --entity-count, --rng and --seed is kept
+  // for restore(); otherwise the file is started afresh.  Returns false,
+  // after logging, if the file cannot be used.
+  bool open();
+
+  // Whether open() found a checkpoint to resume from
+  bool resumable() const { return resumable_; }
+
+  // Sizes entities and loads the last checkpoint into them and walk.
+  // Returns false, after logging, if the checkpoint is corrupt.
+  bool restore(random_generator &walk);
+
+  // Called once every job of the tick just produced has finished; saves the
+  // state if a checkpoint is due, or unconditionally if force is set
+  void tickAcknowledged(random_generator &walk, bool force = false);
+
+  // Waits for the last checkpoint to reach the disk
+  void finish();
+
+  // Prints how many checkpoints were taken and how long the loop paused
+  void report() const;
+
+private:
+  Checkpointer(const Checkpointer &);
+  Checkpointer &operator=(const Checkpointer &);
+
+  void run();
+  char *slot(int index) const;
+
+  std::string path_;
+  int fd_;
+  char *map_;
+  size_t mapSize_;
+  size_t slotSize_;
+  bool resumable_;
+  // An image of a slot, and whether it holds the fields that never change
+  std::vector<char> staging_;
+  bool staticStaged_;
+  Clock::time_point nextDue_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  // The slot waiting to be flushed and committed; -1 when idle
+  int pending_;
+  uint64_t pendingTicks_;
+  bool stopping_;
+
+  int64_t taken_;
+  int64_t deferred_;
+  Clock::duration totalPause_;
+  Clock::duration maxPause_;
+};
@@ -0,0 +1,197 @@
+#include "compress.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// zlib's window bits, plus 16 for a gzip rather than zlib wrapper.  HTTP's
+// "deflate" coding is the zlib format.
+const int ZLIB_WINDOW_BITS = 15;
+const int GZIP_WINDOW_BITS = 15 + 16;
+const int ZLIB_MEMORY_LEVEL = 8;
+
+// Output space added to the body before each call into the codec
+const size_t OUTPUT_CHUNK = 64 * 1024;
+
+// zlib's automatic gzip or zlib header detection
+const int INFLATE_ANY_WINDOW_BITS = 15 + 32;
+
+} // namespace
+
+bool decompressPayload(const std::string &encoding, const std::string &body,
+                       std::string &out) {
+  out.clear();
+#ifdef HAVE_ZSTD
+  if (encoding == "zstd") {
+    ZSTD_DCtx *zstd = ZSTD_createDCtx();
+    ZSTD_inBuffer in = {body.data(), body.size(), 0};
+    size_t result = 0;
+    bool truncated = false;
+    do {
+      size_t used = out.size();
+      out.resize(used + OUTPUT_CHUNK);
+      ZSTD_outBuffer chunk = {&out[used], OUTPUT_CHUNK, 0};
+      result = ZSTD_decompressStream(zstd, &chunk, &in);
+      out.resize(used + chunk.pos);
+      // With the input used up, a frame that is still incomplete and yields
+      // nothing more never will: the body was cut short, or empty
+      truncated = in.pos == in.size && chunk.pos == 0 && result != 0;
+    } while (!ZSTD_isError(result) && !truncated &&
+             (in.pos < in.size || result != 0));
+    ZSTD_freeDCtx(zstd);
+    return !ZSTD_isError(result) && !truncated;
+  }
+#endif
+  if (encoding != "gzip" && encoding != "deflate") {
+    return false;
+  }
+  z_stream zlib;
+  memset(&zlib, 0, sizeof(zlib));
+  if (inflateInit2(&zlib, INFLATE_ANY_WINDOW_BITS) != Z_OK) {
+    return false;
+  }
+  zlib.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+  zlib.avail_in = static_cast<uInt>(body.size());
+  int result;
+  do {
+    size_t used = out.size();
+    out.resize(used + OUTPUT_CHUNK);
+    zlib.next_out = reinterpret_cast<Bytef *>(&out[used]);
+    zlib.avail_out = OUTPUT_CHUNK;
+    result = inflate(&zlib, Z_NO_FLUSH);
+    out.resize(used + OUTPUT_CHUNK - zlib.avail_out);
+  } while (result == Z_OK);
+  inflateEnd(&zlib);
+  return result == Z_STREAM_END;
+}
+
+PayloadCompressor::PayloadCompressor(const std::string &codec, int level)
+    : codec_(codec), out_(NULL), inputUsed_(0), totalIn_(0), codecTime_(0) {
+  if (!supported(codec)) {
+    std::cerr << "Unsupported compression: " << codec << std::endl;
+    exit(1);
+  }
+#ifdef HAVE_ZSTD
+  zstd_ = NULL;
+  if (codec_ == "zstd") {
+    zstd_ = ZSTD_createCCtx();
+    if (!zstd_ || ZSTD_isError(ZSTD_CCtx_setParameter(
+                      zstd_, ZSTD_c_compressionLevel, level))) {
+      std::cerr << "Could not initialize zstd" << std::endl;
+      exit(1);
+    }
+    return;
+  }
+#endif
+  memset(&zlib_, 0, sizeof(zlib_));
+  int windowBits = codec_ == "gzip" ? GZIP_WINDOW_BITS : ZLIB_WINDOW_BITS;
+  if (deflateInit2(&zlib_, level == 0 ? Z_DEFAULT_COMPRESSION : level,
+                   Z_DEFLATED, windowBits, ZLIB_MEMORY_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    std::cerr << "Could not initialize zlib: " << codec_ << " level " << level
+              << std::endl;
+    exit(1);
+  }
+}
+
+PayloadCompressor::~PayloadCompressor() {
+#ifdef HAVE_ZSTD
+  if (zstd_) {
+    ZSTD_freeCCtx(zstd_);
+    return;
+  }
+#endif
+  deflateEnd(&zlib_);
+}
+
+bool PayloadCompressor::supported(const std::string &codec) {
+#ifdef HAVE_ZSTD
+  if (codec == "zstd") {
+    return true;
+  }
+#endif
+  return codec == "gzip" || codec == "deflate";
+}
+
+const char *PayloadCompressor::encoding() const { return codec_.c_str(); }
+
+void PayloadCompressor::begin(rapidjson::StringBuffer &out) {
+  out_ = &out;
+  inputUsed_ = 0;
+  totalIn_ = 0;
+#ifdef HAVE_ZSTD
+  if (zstd_) {
+    ZSTD_CCtx_reset(zstd_, ZSTD_reset_session_only);
+    return;
+  }
+#endif
+  deflateReset(&zlib_);
+}
+
+void PayloadCompressor::write(const char *data, size_t size) {
+  while (size > 0) {
+    if (inputUsed_ == INPUT_SIZE) {
+      compress(false);
+    }
+    size_t count = std::min(size, INPUT_SIZE - inputUsed_);
+    memcpy(input_ + inputUsed_, data, count);
+    inputUsed_ += count;
+    data += count;
+    size -= count;
+  }
+}
+
+size_t PayloadCompressor::end() {
+  compress(true);
+  out_ = NULL;
+  return totalIn_;
+}
+
+void PayloadCompressor::compress(bool last) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  runCodec(last);
+  codecTime_ += std::chrono::steady_clock::now() - start;
+}
+
+void PayloadCompressor::runCodec(bool last) {
+  totalIn_ += inputUsed_;
+#ifdef HAVE_ZSTD
+  if (zstd_) {
+    ZSTD_inBuffer in = {input_, inputUsed_, 0};
+    ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+    size_t remaining;
+    do {
+      char *space = out_->Push(OUTPUT_CHUNK);
+      ZSTD_outBuffer out = {space, OUTPUT_CHUNK, 0};
+      remaining = ZSTD_compressStream2(zstd_, &out, &in, mode);
+      if (ZSTD_isError(remaining)) {
+        std::cerr << "zstd: " << ZSTD_getErrorName(remaining) << std::endl;
+        exit(1);
+      }
+      out_->Pop(OUTPUT_CHUNK - out.pos);
+    } while (last ? remaining != 0 : in.pos < in.size);
+    inputUsed_ = 0;
+    return;
+  }
+#endif
+  zlib_.next_in = reinterpret_cast<Bytef *>(input_);
+  zlib_.avail_in = static_cast<uInt>(inputUsed_);
+  int flush = last ? Z_FINISH : Z_NO_FLUSH;
+  int result;
+  do {
+    zlib_.next_out = reinterpret_cast<Bytef *>(out_->Push(OUTPUT_CHUNK));
+    zlib_.avail_out = OUTPUT_CHUNK;
+    result = deflate(&zlib_, flush);
+    if (result == Z_STREAM_ERROR) {
+      std::cerr << "zlib: " << (zlib_.msg ? zlib_.msg : "stream error")
+                << std::endl;
+      exit(1);
+    }
+    out_->Pop(zlib_.avail_out);
+  } while (last ? result != Z_STREAM_END : zlib_.avail_in > 0);
+  inputUsed_ = 0;
+}
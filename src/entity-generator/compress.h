@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "rapidjson/stringbuffer.h"
+
+// Decodes a body sent with Content-Encoding encoding (gzip, deflate or zstd)
+// into out.  Returns false if the encoding is unsupported or the body is
+// corrupt.
+bool decompressPayload(const std::string &encoding, const std::string &body,
+                       std::string &out);
+
+// Compresses a request body as it is written, for --compress.  It is a
+// rapidjson output stream, so a Writer can serialize straight into it and the
+// uncompressed JSON never exists in full.  One compressor is reused across
+// ticks so the codec state is only allocated once.
+class PayloadCompressor {
+public:
+  typedef char Ch;
+
+  // codec is gzip, deflate or zstd; level 0 picks the codec's default
+  PayloadCompressor(const std::string &codec, int level);
+  ~PayloadCompressor();
+
+  // Whether codec is known and was compiled in
+  static bool supported(const std::string &codec);
+
+  // The Content-Encoding value for the codec
+  const char *encoding() const;
+
+  // Starts a new body, appending its compressed bytes to out
+  void begin(rapidjson::StringBuffer &out);
+  void write(const char *data, size_t size);
+  // Flushes the codec and finishes the body.  Returns the uncompressed size.
+  size_t end();
+
+  // Uncompressed bytes written to the current body so far
+  size_t bytesIn() const { return totalIn_ + inputUsed_; }
+
+  // Time spent in the codec over the compressor's life
+  std::chrono::steady_clock::duration codecTime() const { return codecTime_; }
+
+  void Put(char c) {
+    if (inputUsed_ == INPUT_SIZE) {
+      compress(false);
+    }
+    input_[inputUsed_++] = c;
+  }
+  void Flush() {}
+
+private:
+  PayloadCompressor(const PayloadCompressor &);
+  PayloadCompressor &operator=(const PayloadCompressor &);
+
+  // Compresses the buffered input, finishing the body if last, and adds the
+  // time taken to codecTime_
+  void compress(bool last);
+  void runCodec(bool last);
+
+  static const size_t INPUT_SIZE = 64 * 1024;
+
+  std::string codec_;
+  z_stream zlib_;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zstd_;
+#endif
+  rapidjson::StringBuffer *out_;
+  char input_[INPUT_SIZE];
+  size_t inputUsed_;
+  size_t totalIn_;
+  std::chrono::steady_clock::duration codecTime_;
+};
@@ -1,227 +1,150 @@
-#include <array>
-#include <cmath>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <set>
 #include <string>
-#include <unistd.h>
-
-#include <boost/algorithm/string.hpp>
-#include <boost/date_time/gregorian/gregorian_types.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
-#include <boost/date_time/posix_time/posix_time_types.hpp>
-#include <boost/format.hpp>
-#include <boost/generator_iterator.hpp>
+#include <vector>
+
 #include <boost/program_options.hpp>
 #include <boost/random.hpp>
-#include <curl/curl.h>
 
-#include "rapidjson/document.h"
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
+#include "checkpoint.h"
+#include "compress.h"
+#include "entity.h"
+#include "file-sink.h"
+#include "job-tracker.h"
+#include "log.h"
+#include "metrics.h"
+#include "pacing.h"
+#include "pipeline.h"
+#include "recording.h"
+#include "serialize.h"
+#include "shard.h"
+#include "upload.h"
+#include "walk-kernel.h"
 
 namespace po = boost::program_options;
 
-const std::array<double, 3> CENTER_OF_US = {{-98.5795, 39.8282, 0.}};
-
-struct CommandLineOptions {
-  bool initialize = true;
-  int timeInterval = 1;
-  int entityCount = 100;
-  bool centerStart = false;
-  double stepSize = 0.1;
-  bool marchWest = false;
-  bool live = false;
-  bool ungoverned = false;
-  int daysToRun = 1;
-  uint64_t startTime = 0;
-  uint64_t endtimeOffset = 0;
-  std::string hostname;
-  std::string dataset;
-  std::string apiKey;
-  std::string kind;
-  bool insecure = false;
-  bool testPattern = false;
-  bool disableSslVerifyPeer = false;
-};
-
-struct Entity {
-  std::string id;
-  std::string kind;
-  std::array<double, 3> location;
-  std::array<double, 3> initialLocation;
-  uint64_t timestamp;
-};
-
-std::vector<Entity> entityList;
-CommandLineOptions options;
-
-typedef boost::variate_generator<boost::mt19937,
-                                 boost::random::uniform_real_distribution<>>
-    random_generator;
-
-boost::mt19937 alg_start_lat(1);
-boost::random::uniform_real_distribution<> start_lat_range(24., 49.);
-random_generator start_lat(alg_start_lat, start_lat_range);
-
-boost::mt19937 alg_start_lon(2);
-boost::random::uniform_real_distribution<> start_lon_range(-125., -66.);
-random_generator start_lon(alg_start_lon, start_lon_range);
-
-const double getStartDate() {
-  static boost::posix_time::ptime date(boost::gregorian::date(1996, 1, 1));
-  static boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
-  return (date - epoch).total_milliseconds();
-}
+// Bodies per second a throughput target is split into by default
+const double RATE_BATCHES_PER_SECOND = 20;
 
-const long long nowUTC() {
-  static boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
-  boost::posix_time::ptime now =
-      boost::posix_time::microsec_clock::universal_time();
+// Options the --shards coordinator sets for each worker itself rather than
+// passing on
+const std::set<std::string> SHARD_OWN_OPTIONS = {
+    "shards", "shard-retries", "progress-fd", "start-tick", "end-tick",
+    "output", "record", "checkpoint", "resume", "metrics-port"};
 
-  return (now - epoch).total_milliseconds();
+// Ticks in --days at --time-interval, which parseCommandLine() keeps within
+// an int
+double daysTickCount() {
+  return 3600.0 * 24 * options.daysToRun / options.timeInterval;
 }
 
-const std::string getTimeString() {
-  return boost::posix_time::to_iso_string(
-      boost::posix_time::second_clock::universal_time());
+// The tick a run stops before
+int updateCount() {
+  return options.endTick > 0 ? options.endTick
+                             : static_cast<int>(daysTickCount());
 }
 
-void moveToNextTestLocation(double &lng, double &lat, const double initialLng,
-                            const double initialLat) {
-  if (lng == initialLng && lat == initialLat) {
-    lng = initialLng + options.stepSize;
-  } else if (lng == initialLng + options.stepSize && lat == initialLat) {
-    lat = initialLat + options.stepSize;
-  } else if (lng == initialLng + options.stepSize &&
-             lat == initialLat + options.stepSize) {
-    lng = initialLng;
-  } else if (lng == initialLng && lat == initialLat + options.stepSize) {
-    lat = initialLat;
-  } else {
-    lat = initialLat;
-    lng = initialLng;
+void updateEntities(random_generator &walk, PayloadBuffer &buffer) {
+  {
+    PhaseTimer timer(PHASE_SIMULATE);
+    stepEntities(walk);
   }
+  metrics.add(COUNTER_TICKS);
+  LOG(LOG_DEBUG) << "Updating " << entities.size() << " entities";
+  serializePayload(entities, buffer);
 }
 
-void updateLocation(std::vector<Entity>::iterator topo,
-                    random_generator &walk) {
-  double lng = topo->location[0];
-  double lat = topo->location[1];
-  double newLat = lat;
-  double newLng = lng;
-
-  if (options.testPattern) {
-    moveToNextTestLocation(newLng, newLat, topo->initialLocation[0],
-                           topo->initialLocation[1]);
-  } else {
-    newLat += walk();
-    newLng += walk();
-    if (options.marchWest) {
-      newLng = lng - options.stepSize;
-    }
-
-    if (lng > -180 && newLng < -180) {
-      newLng += 360;
-    } else if (lng < 180 and newLng > 180) {
-      newLng -= 360;
-    }
-    if (lat > -90 && newLat < -90) {
-      newLat += 180;
-    } else if (lat < 90 and newLat > 90) {
-      newLat -= 180;
+// The serial loop for --output: every tick's bodies are appended to sink as
+// fast as the scheduler and any rate targets allow
+void writeEntities(random_generator &walk, int updateCount, FileSink &sink) {
+  TickScheduler scheduler;
+  RateLimiter limiter;
+  PayloadBuffer entitiesBuffer;
+  for (int count = static_cast<int>(entities.ticks); count < updateCount;
+       ++count) {
+    updateEntities(walk, entitiesBuffer);
+    const char *body = entitiesBuffer.data();
+    for (size_t c = 0; c < entitiesBuffer.chunkCount(); ++c) {
+      if (RateLimiter::enabled()) {
+        limiter.acquire(entitiesBuffer.chunkEntities[c],
+                        entitiesBuffer.chunkSize(c));
+      }
+      if (!sink.write(body + entitiesBuffer.chunkBegin(c),
+                      entitiesBuffer.chunkSize(c))) {
+        exit(1);
+      }
+      metrics.add(COUNTER_ENTITIES, entitiesBuffer.chunkEntities[c]);
+      metrics.add(COUNTER_BYTES, entitiesBuffer.chunkSize(c));
     }
+    scheduler.waitForNextTick();
+  }
+  if (!sink.close()) {
+    exit(1);
   }
 
-  topo->location[0] = newLng;
-  topo->location[1] = newLat;
-}
-
-rapidjson::Value getJsonPath(std::array<double, 3> location,
-                             rapidjson::Document::AllocatorType &allocator) {
-  rapidjson::Value jsonLoc(rapidjson::kObjectType);
-  jsonLoc.AddMember("x", rapidjson::Value(location[0]), allocator);
-  jsonLoc.AddMember("y", rapidjson::Value(location[1]), allocator);
-  jsonLoc.AddMember("z", rapidjson::Value(location[2]), allocator);
-  rapidjson::Value path(rapidjson::kArrayType);
-  path.PushBack(jsonLoc, allocator);
-  return path;
-}
-
-std::array<double, 3> getGridLocation(int index, int entityCount) {
-  int side = ceil(sqrt(static_cast<double>(entityCount)));
-  int row = index / side;
-  int col = index % side;
-  return {{static_cast<double>(col) * options.stepSize * 3,
-           static_cast<double>(row) * options.stepSize * 3, 0}};
+  scheduler.report();
+  if (RateLimiter::enabled()) {
+    limiter.report();
+  }
+  sink.report();
 }
 
-void initializeEntities() {
-  for (int i = 0; i < options.entityCount; ++i) {
-    Entity newEntity;
-    newEntity.id = str(boost::format("live-test-%1%") % i);
-    if (options.testPattern) {
-      newEntity.location = getGridLocation(i, options.entityCount);
-    } else if (options.centerStart) {
-      newEntity.location = CENTER_OF_US;
-    } else {
-      newEntity.location = {{start_lon(), start_lat(), 0.}};
-    }
-    newEntity.initialLocation = newEntity.location;
-    if (options.live) {
-      newEntity.timestamp = nowUTC();
-    } else {
-      newEntity.timestamp = options.startTime;
+// The serial loop for --record: ticks are generated back to back and stored
+// with the time each was due
+void recordEntities(random_generator &walk, int updateCount) {
+  RecordingWriter writer;
+  if (!writer.open(options.record)) {
+    exit(1);
+  }
+  PayloadBuffer entitiesBuffer;
+  const int first = static_cast<int>(entities.ticks);
+  for (int count = first; count < updateCount; ++count) {
+    updateEntities(walk, entitiesBuffer);
+    const uint64_t dueNs =
+        static_cast<uint64_t>((count - first) * options.timeInterval * 1e9);
+    if (!writer.writeTick(dueNs, entities.timestamp[0], entitiesBuffer)) {
+      exit(1);
     }
-    newEntity.kind = options.kind;
-    entityList.push_back(newEntity);
+  }
+  if (!writer.close()) {
+    exit(1);
   }
 }
 
-const std::string updateEntities(random_generator &walk) {
-  rapidjson::Document jsonDoc;
-  jsonDoc.SetObject();
-
-  rapidjson::Value entities(rapidjson::kArrayType);
+// Sends --replay in place of a generated run
+void replay() {
+  Recording recording;
+  if (!recording.open(options.replay)) {
+    exit(1);
+  }
+  // Bodies go out as they were recorded, so they are labelled that way
+  const std::string codec = recording.header().compress;
+  if (codec != "none" && !PayloadCompressor::supported(codec)) {
+    LOG(LOG_ERROR) << options.replay << " was recorded with unknown codec "
+                   << codec;
+    exit(1);
+  }
+  if (options.replayRebase && codec != "none") {
+    LOG(LOG_ERROR) << "Compressed recordings cannot be rebased";
+    exit(1);
+  }
+  options.compress = codec;
 
-  int count = 0;
-  for (std::vector<Entity>::iterator entity = entityList.begin();
-       entity != entityList.end(); ++entity) {
-    updateLocation(entity, walk);
-    if (options.live) {
-      entity->timestamp = nowUTC();
-    } else {
-      entity->timestamp += options.timeInterval * 1000;
-    }
-    rapidjson::Value newEntity(rapidjson::kObjectType);
-    newEntity.AddMember("identity",
-                        rapidjson::Value(entity->id.c_str(), entity->id.size()),
-                        jsonDoc.GetAllocator());
-    newEntity.AddMember("timestamp_ms", rapidjson::Value(entity->timestamp),
-                        jsonDoc.GetAllocator());
-    newEntity.AddMember(
-        "endtime_ms",
-        rapidjson::Value(entity->timestamp + options.endtimeOffset),
-        jsonDoc.GetAllocator());
-    newEntity.AddMember(
-        "kind", rapidjson::Value(entity->kind.c_str(), entity->kind.size()),
-        jsonDoc.GetAllocator());
-    newEntity.AddMember("path",
-                        getJsonPath(entity->location, jsonDoc.GetAllocator()),
-                        jsonDoc.GetAllocator());
-    entities.PushBack(newEntity, jsonDoc.GetAllocator());
-    ++count;
-  }
-  std::cout << getTimeString() << ": Updating " << count << " entities"
-            << std::endl;
-  jsonDoc.AddMember("entities", entities, jsonDoc.GetAllocator());
-
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  jsonDoc.Accept(writer);
-  std::string jsonStr = buffer.GetString();
-  return jsonStr;
+  MetricsReporter reporter;
+  reporter.start();
+  replayRecording(recording);
+  reporter.stop();
 }
 
-void parseCommandLine(int argc, char *argv[]) {
+// Parses and checks the command line into options, exiting on error.  The
+// options a --shards coordinator passes on to its workers are left in
+// workerArgs.
+void parseCommandLine(int argc, char *argv[],
+                      std::vector<std::string> &workerArgs) {
   po::options_description desc(
       "entity-generator is a utility for sending data to Conduce."
       "\n\nConfiguration options");
@@ -232,6 +155,59 @@ void parseCommandLine(int argc, char *argv[]) {
       po::value<std::string>(&options.hostname)
           ->default_value("dev-app.conduce.com"),
       "Resolvable name or IP address of Conduce server")(
+      "base-url", po::value<std::string>(&options.baseUrl),
+      "Scheme, host, port and path prefix of the Conduce server, e.g. "
+      "http://localhost:8080; overrides --host")(
+      "unix-socket", po::value<std::string>(&options.unixSocket),
+      "Connect through this Unix-domain socket instead of TCP; the host in "
+      "the URL is still sent")(
+      "output", po::value<std::string>(&options.output),
+      "Write add-data bodies to this file:///PATH instead of POSTing them; "
+      "no server is contacted")(
+      "output-format",
+      po::value<std::string>(&options.outputFormat)->default_value("ndjson"),
+      "How --output separates bodies: ndjson (one per line) or json "
+      "(concatenated)")(
+      "output-rotate-bytes",
+      po::value<uint64_t>(&options.outputRotateBytes)->default_value(0),
+      "Start a new, numbered --output file before one would exceed this "
+      "many bytes; 0 writes a single file")(
+      "output-direct",
+      po::bool_switch(&options.outputDirect)->default_value(false),
+      "Write --output with O_DIRECT, bypassing the page cache")(
+      "record", po::value<std::string>(&options.record),
+      "Write the run's add-data bodies and tick times to this recording, as "
+      "fast as they can be generated, instead of sending them")(
+      "replay", po::value<std::string>(&options.replay),
+      "Send the bodies in this recording instead of generating entities")(
+      "replay-speed",
+      po::value<double>(&options.replaySpeed)->default_value(1),
+      "Multiple of the recorded tick rate to replay at; 0 replays as fast as "
+      "possible")(
+      "replay-rebase",
+      po::bool_switch(&options.replayRebase)->default_value(false),
+      "Move the replayed timestamps so the first tick is now (uncompressed "
+      "recordings only)")(
+      "checkpoint", po::value<std::string>(&options.checkpoint),
+      "Save the simulation state to this file every --checkpoint-interval "
+      "seconds, once the tick's jobs have finished.  The loop pauses to copy "
+      "24-32 bytes per entity, split across --threads: a few ms for up to "
+      "about 1M entities per thread")(
+      "checkpoint-interval",
+      po::value<double>(&options.checkpointInterval)->default_value(60),
+      "Seconds between checkpoints")(
+      "resume", po::bool_switch(&options.resume)->default_value(false),
+      "Carry on from the last tick saved in --checkpoint, if there is one")(
+      "shards", po::value<int>(&options.shards)->default_value(0),
+      "Split the ticks between this many worker processes, each uploading "
+      "(or writing --output, --record and --checkpoint files) on its own; 0 "
+      "runs in this process.  Needs --rng=stream or --rng=philox")(
+      "shard-retries",
+      po::value<int>(&options.shardRetries)->default_value(2),
+      "Times a failed shard is restarted before the run gives up on it")(
+      "progress-fd", po::value<int>(&options.progressFd)->default_value(-1),
+      "Report progress to this file descriptor (set by --shards for its "
+      "workers)")(
       "dataset-id", po::value<std::string>(&options.dataset),
       "Dataset unique identifier")(
       "api-key", po::value<std::string>(&options.apiKey),
@@ -240,6 +216,11 @@ void parseCommandLine(int argc, char *argv[]) {
       "Number of entities to generate topologies for")(
       "days", po::value<int>(&options.daysToRun)->default_value(1),
       "Days of topologies to send to pool server")(
+      "start-tick", po::value<int>(&options.startTick)->default_value(0),
+      "First tick to produce; the entities are advanced to it directly "
+      "rather than simulated tick by tick (not with --live)")(
+      "end-tick", po::value<int>(&options.endTick)->default_value(0),
+      "Tick to stop before, overriding --days; 0 runs to the end of --days")(
       "center-start",
       po::value<bool>(&options.centerStart)->default_value(false),
       "Originate all nodes at the center of the United States.")(
@@ -253,8 +234,30 @@ void parseCommandLine(int argc, char *argv[]) {
       "Disable SSL peer verification (local env only)")(
       "step-size", po::value<double>(&options.stepSize)->default_value(0.1),
       "Distance to move nodes every time interval (decimal degrees)")(
-      "time-interval", po::value<int>(&options.timeInterval)->default_value(1),
-      "Seconds between topology updates")(
+      "time-interval",
+      po::value<double>(&options.timeInterval)->default_value(1),
+      "Seconds between topology updates; may be fractional, down to 0.001")(
+      "behind",
+      po::value<std::string>(&options.behind)->default_value("catch-up"),
+      "When a governed run falls behind: catch-up sends the late ticks back "
+      "to back, skip abandons the missed deadlines")(
+      "target-entities-per-sec",
+      po::value<double>(&options.targetEntitiesPerSec)->default_value(0),
+      "Send entities at this rate instead of once per --time-interval; 0 for "
+      "no target")(
+      "target-bytes-per-sec",
+      po::value<double>(&options.targetBytesPerSec)->default_value(0),
+      "Send add-data bodies at this many bytes per second, as sent (after "
+      "compression); 0 for no target")(
+      "ramp", po::value<std::string>(&options.ramp)->default_value("none"),
+      "Raise the targets gradually: none, linear or step")(
+      "ramp-seconds",
+      po::value<double>(&options.rampSeconds)->default_value(60),
+      "Time taken to ramp up to the targets (s)")(
+      "ramp-start", po::value<double>(&options.rampStart)->default_value(0.1),
+      "Fraction of the targets a ramp starts at")(
+      "ramp-steps", po::value<int>(&options.rampSteps)->default_value(5),
+      "Number of rates a step ramp holds, from --ramp-start to the targets")(
       "endtime-offset",
       po::value<uint64_t>(&options.endtimeOffset)->default_value(0),
       "Duration after which entity expires (ms)")(
@@ -266,11 +269,92 @@ void parseCommandLine(int argc, char *argv[]) {
       "Disables SSL verifications")(
       "test-pattern",
       po::bool_switch(&options.testPattern)->default_value(false),
-      "Override random motion entity behavior and generate a test pattern.");
+      "Override random motion entity behavior and generate a test pattern.")(
+      "serializer",
+      po::value<std::string>(&options.serializer)->default_value("sax"),
+      "JSON serialization strategy: sax (stream from entity state) or dom "
+      "(build a rapidjson::Document first)")(
+      "pipeline-depth",
+      po::value<int>(&options.pipelineDepth)->default_value(0),
+      "Run simulation, serialization, upload and job tracking on separate "
+      "threads with up to this many ticks in flight (0 runs them serially)")(
+      "max-in-flight", po::value<int>(&options.maxInFlight)->default_value(1),
+      "Number of add-data POSTs to keep in flight concurrently (requires "
+      "--pipeline-depth)")(
+      "max-retries", po::value<int>(&options.maxRetries)->default_value(5),
+      "Times an add-data POST answered with a 5xx is retried before it is "
+      "given up on")(
+      "retry-initial-ms",
+      po::value<int>(&options.retryInitialMs)->default_value(100),
+      "Backoff before the first retry of a POST (ms); doubles with each "
+      "retry, and is jittered by up to half")(
+      "retry-max-ms",
+      po::value<int>(&options.retryMaxMs)->default_value(10000),
+      "Longest backoff between retries of a POST (ms)")(
+      "job-poll-initial-ms",
+      po::value<int>(&options.jobPollInitialMs)->default_value(5),
+      "Delay before re-polling an unfinished add-data job (ms); doubles "
+      "after each poll")(
+      "job-poll-max-ms",
+      po::value<int>(&options.jobPollMaxMs)->default_value(1000),
+      "Longest delay between polls of an unfinished add-data job (ms)")(
+      "rng", po::value<std::string>(&options.rng)->default_value("mt19937"),
+      "Random number source: mt19937 (one shared generator, reproduces "
+      "earlier runs), stream (one stream per entity) or philox (counter-based, "
+      "any entity at any tick).  --threads needs stream or philox")(
+      "seed", po::value<uint64_t>(&options.seed)->default_value(0),
+      "Seed for --rng=stream and --rng=philox")(
+      "threads", po::value<int>(&options.threads)->default_value(1),
+      "Threads used to move entities each tick (requires --rng=stream or "
+      "--rng=philox)")(
+      "simd", po::value<std::string>(&options.simd)->default_value("auto"),
+      "Random walk kernel: auto, avx2, sse2 or scalar.  All produce "
+      "identical positions")(
+      "compress",
+      po::value<std::string>(&options.compress)->default_value("none"),
+      "Content-Encoding for add-data bodies: none, gzip, deflate or zstd")(
+      "compress-level",
+      po::value<int>(&options.compressLevel)->default_value(0),
+      "Compression level (1-9 for gzip and deflate, 1-19 for zstd); 0 uses "
+      "the codec's default")(
+      "max-batch-bytes",
+      po::value<uint64_t>(&options.maxBatchBytes)->default_value(0),
+      "Split each tick into add-data requests of at most this many bytes "
+      "of JSON, measured before compression; 0 for no limit")(
+      "metrics-interval",
+      po::value<double>(&options.metricsInterval)->default_value(10),
+      "Seconds between latency and throughput summaries; 0 prints one only "
+      "at exit")(
+      "log-level",
+      po::value<std::string>(&options.logLevel)->default_value("info"),
+      "Least severe messages logged: debug (adds a line per tick, request "
+      "and job), info, warn or error")(
+      "log-format",
+      po::value<std::string>(&options.logFormat)->default_value("text"),
+      "Log as text lines or as JSON lines (json)")(
+      "metrics-port", po::value<int>(&options.metricsPort)->default_value(0),
+      "Serve counters and latency histograms in Prometheus text format at "
+      "http://ADDRESS:PORT/metrics; 0 for no endpoint")(
+      "metrics-address",
+      po::value<std::string>(&options.metricsAddress)
+          ->default_value("127.0.0.1"),
+      "Address the metrics endpoint listens on")(
+      "max-batch-entities",
+      po::value<int>(&options.maxBatchEntities)->default_value(0),
+      "Split each tick into add-data requests of at most this many "
+      "entities; 0 for no limit");
 
   po::variables_map vm;
-  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::parsed_options parsed = po::parse_command_line(argc, argv, desc);
+  po::store(parsed, vm);
   po::notify(vm);
+  for (size_t i = 0; i < parsed.options.size(); ++i) {
+    if (!SHARD_OWN_OPTIONS.count(parsed.options[i].string_key)) {
+      workerArgs.insert(workerArgs.end(),
+                        parsed.options[i].original_tokens.begin(),
+                        parsed.options[i].original_tokens.end());
+    }
+  }
 
   if (vm.count("help")) {
     std::cout << desc << "\n";
@@ -279,252 +363,472 @@ void parseCommandLine(int argc, char *argv[]) {
 
   bool abort = false;
 
-  if (!vm.count("dataset-id")) {
+  std::string outputPath;
+  if (!options.output.empty() &&
+      !FileSink::parseUrl(options.output, outputPath)) {
+    std::cerr << "Unsupported output: " << options.output << std::endl;
+    std::cerr << "entity-generator --output=file:///PATH" << std::endl;
+    abort = true;
+  }
+  if (options.outputFormat != "ndjson" && options.outputFormat != "json") {
+    std::cerr << "Unknown output format: " << options.outputFormat
+              << std::endl;
+    std::cerr << "entity-generator --output-format=ndjson|json" << std::endl;
+    abort = true;
+  }
+  // Raw deflate streams cannot be concatenated into one file
+  if (!options.output.empty() && options.compress == "deflate") {
+    std::cerr << "Files can be compressed with gzip or zstd, not deflate."
+              << std::endl;
+    std::cerr << "entity-generator --output=file:///PATH --compress=gzip|zstd"
+              << std::endl;
+    abort = true;
+  }
+
+  int sources = !options.output.empty() + !options.record.empty() +
+                !options.replay.empty();
+  if (sources > 1) {
+    std::cerr << "Only one of --output, --record and --replay may be given."
+              << std::endl;
+    abort = true;
+  }
+  if (!options.record.empty() && options.pipelineDepth > 0) {
+    std::cerr << "Recordings are written by the serial loop." << std::endl;
+    std::cerr << "entity-generator --record=PATH --pipeline-depth=0"
+              << std::endl;
+    abort = true;
+  }
+  if (!(options.replaySpeed >= 0)) {
+    std::cerr << "--replay-speed must not be negative" << std::endl;
+    abort = true;
+  }
+  if (options.replayRebase && options.replay.empty()) {
+    std::cerr << "Only replays are rebased." << std::endl;
+    std::cerr << "entity-generator --replay=PATH --replay-rebase" << std::endl;
+    abort = true;
+  }
+
+  if (!options.checkpoint.empty() &&
+      (options.pipelineDepth > 0 || sources > 0)) {
+    std::cerr << "Checkpoints are taken by the serial upload loop only."
+              << std::endl;
+    std::cerr << "entity-generator --checkpoint=PATH --pipeline-depth=0"
+              << std::endl;
+    abort = true;
+  }
+  if (!(options.checkpointInterval > 0)) {
+    std::cerr << "--checkpoint-interval must be positive" << std::endl;
+    abort = true;
+  }
+  if (options.resume && options.checkpoint.empty()) {
+    std::cerr << "Resuming needs a checkpoint." << std::endl;
+    std::cerr << "entity-generator --checkpoint=PATH --resume" << std::endl;
+    abort = true;
+  }
+
+  // Nothing is sent to a server when writing to files
+  const bool sending = options.output.empty() && options.record.empty();
+  if (!vm.count("dataset-id") && sending) {
     std::cerr << "A dataset ID must be provided." << std::endl;
     std::cerr << "entity-generator --dataset-id=ID" << std::endl;
     abort = true;
   }
-  if (!vm.count("api-key")) {
+  if (!vm.count("api-key") && sending) {
     std::cerr << "An API key must be provided." << std::endl;
     std::cerr << "entity-generator --api-key=TOKEN" << std::endl;
     abort = true;
   }
 
-  if (abort) {
-    exit(1);
+  // Every tick reads the first entity's timestamp, and an empty tick is no
+  // add-data body at all
+  if (options.entityCount < 1) {
+    std::cerr << "--entity-count must be at least 1" << std::endl;
+    abort = true;
   }
-}
 
-struct string {
-  char *ptr;
-  size_t len;
-};
-
-// A function that dumps response data from a curl request into the provided
-// std::string
-size_t writefunc(void *ptr, size_t size, size_t nmemb, std::string *s) {
-  s->append((char *)ptr, size * nmemb);
-  // std::cout << *s << std::endl;
-  return size * nmemb;
-}
+  if (!(options.timeInterval >= 0.001)) {
+    std::cerr << "--time-interval must be at least 0.001 seconds"
+              << std::endl;
+    abort = true;
+  } else if (options.endTick == 0 &&
+             !(daysTickCount() <= std::numeric_limits<int>::max())) {
+    std::cerr << "--days=" << options.daysToRun << " at --time-interval="
+              << options.timeInterval << " is more than "
+              << std::numeric_limits<int>::max() << " ticks" << std::endl;
+    std::cerr << "entity-generator --days=N --end-tick=TICK" << std::endl;
+    abort = true;
+  }
+  if (options.behind != "catch-up" && options.behind != "skip") {
+    std::cerr << "Unknown policy for falling behind: " << options.behind
+              << std::endl;
+    std::cerr << "entity-generator --behind=catch-up|skip" << std::endl;
+    abort = true;
+  }
 
-// A function that dumps response headers from a curl request into the provided
-// map
-// The map will store header keys and their associated values
-size_t headerfunc(void *ptr, size_t size, size_t nitems,
-                  std::map<std::string, std::string> *m) {
-  std::vector<std::string> strs;
-  std::string data((char *)ptr, size * nitems);
-  boost::algorithm::split(strs, data, boost::is_any_of(":"));
-  if (strs.size() > 1) {
-    (*m)[boost::algorithm::trim_copy(strs[0])] =
-        boost::algorithm::trim_copy(strs[1]);
+  if (options.startTick < 0 || options.endTick < 0 ||
+      (options.endTick > 0 && options.endTick <= options.startTick)) {
+    std::cerr << "Ticks must satisfy 0 <= --start-tick < --end-tick"
+              << std::endl;
+    abort = true;
+  }
+  if (options.startTick > 0 && options.live) {
+    std::cerr << "Live timestamps come from the clock, so a live run cannot "
+                 "start at a later tick."
+              << std::endl;
+    abort = true;
   }
 
-  return size * nitems;
-}
+  if (options.shards < 0 || options.shardRetries < 0) {
+    std::cerr << "--shards and --shard-retries must not be negative"
+              << std::endl;
+    abort = true;
+  }
+  if (options.shards > 0 && (options.live || !options.replay.empty())) {
+    std::cerr << "Only generated, non-live runs can be split into shards."
+              << std::endl;
+    std::cerr << "entity-generator --shards=N --start-time=MS" << std::endl;
+    abort = true;
+  }
+  // Those shards would each step every earlier tick one by one before
+  // producing anything, so the last would simulate nearly the whole run
+  if (options.shards > 0 &&
+      (options.rng == "mt19937" || options.testPattern)) {
+    std::cerr << "Shards seek to their first tick directly only under "
+                 "--rng=stream or --rng=philox, without --test-pattern."
+              << std::endl;
+    std::cerr << "entity-generator --shards=N --rng=philox" << std::endl;
+    abort = true;
+  }
+  if (options.shards > 0 && options.progressFd >= 0) {
+    std::cerr << "Shard workers cannot be split again." << std::endl;
+    abort = true;
+  }
+  if (options.shards > 0 && options.metricsPort > 0 &&
+      options.metricsPort + options.shards > 65535) {
+    std::cerr << "Shard workers serve metrics on --metrics-port + 1 onwards; "
+                 "choose a lower port"
+              << std::endl;
+    abort = true;
+  }
 
-// Waits for an asynchronous job to complete by querying the provided jobs URI
-void waitForCompletion(std::string &jobUri, CURL *curl) {
-  if (!jobUri.empty()) {
-    char errorBuffer[CURL_ERROR_SIZE];
-    std::cout << getTimeString() << ": Waiting for " << jobUri << std::endl;
-
-    // The location header from an asynchronous call gives the relative URI, so
-    // we need to prepend the host and /conduce/api
-    std::string jobUrl = "https://" + options.hostname + jobUri;
-
-    while (true) {
-      // Reset various CURL fields that get modified by the add_data requests.
-      // Querying an asynchronous job status is a GET request so we want to hold
-      // on to the result data
-      std::string result;
-      std::map<std::string, std::string> headers;
-      curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
-      curl_easy_setopt(curl, CURLOPT_URL, jobUrl.c_str());
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &result);
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, 0);
-      curl_easy_setopt(curl, CURLOPT_POST, 0);
-      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
-
-      CURLcode res;
-      errorBuffer[0] = 0;
-      res = curl_easy_perform(curl);
-      while (res != CURLE_OK) {
-        long responseCode = 0;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode);
-        std::cout << getTimeString() << ": libcurl: " << res << std::endl;
-        std::cout << getTimeString() << responseCode << ": " << errorBuffer
-                  << std::endl;
-        if (responseCode / 100 == 5) {
-          res = curl_easy_perform(curl);
-        } else {
-          break;
-        }
-      }
-      long code = 0;
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-      // A successful query for an asynchronous job should yield a 200 response
-      // But sometimes asynchronous jobs can take a little long to update their
-      // status
-      //(Not likely in this program)
-      // Async job status is stored in redis with an expiration time of 5
-      // minutes.
-      // Every time the progress is updated, the 5 minute expiration is
-      // refreshed.
-      // If a job takes a really long time and the underlying code doesn't do a
-      // good job of
-      // keeping the progress updated, the redis key can vanish, causing the
-      // query for status to fail.
-      // Due to the asynchronous nature of the task, it is very difficult for
-      // the end user to tell if the job failed (likely due to a server bug)
-      // or if it just hasn't updated its progress and it's taking a long time
-      // (also a server bug, but a different kind)
-      // Given that, we'll just be extra safe and print a warning.  If the user
-      // sees nothing but warnings for a long time, it's probably a job failure.
-      // Note that if the job fails without killing the whole server process, it
-      // should finish and report a failing response status.
-      if (code != 200) {
-        std::cout << getTimeString()
-                  << ": Warning: bad response code received: " << code
-                  << std::endl;
-      } else {
-        // The response for a job status query is a json structure containing at
-        // least a 'progress' field (floating point value between 0.0 and 1.0
-        // indicating percentage complete)
-        // When the job is complete, it will also contain a 'response' field
-        // containing an http response code (200 is success for an add_data
-        // call)
-        // and a 'result' field containing a string with any useful response
-        // output (like an error message)
-        // We don't really care about anything in a successful response, so
-        // we're only processing errors here and breaking from the loop on
-        // success
-        rapidjson::Document d;
-        d.Parse(result.c_str());
-        if (d.HasMember("response")) {
-          if (d["response"].GetInt() != 200) {
-            std::cout << getTimeString() << ": add_data failed with code "
-                      << d["response"].GetInt() << "\n\n";
-            std::cout << d["result"].GetString() << std::endl;
-            exit(1);
-          }
-          return;
-        }
-        usleep(1000);
-      }
+  if (options.targetEntitiesPerSec < 0 || options.targetBytesPerSec < 0) {
+    std::cerr << "Throughput targets must not be negative" << std::endl;
+    abort = true;
+  }
+  if (options.ramp != "none" && options.ramp != "linear" &&
+      options.ramp != "step") {
+    std::cerr << "Unknown ramp: " << options.ramp << std::endl;
+    std::cerr << "entity-generator --ramp=none|linear|step" << std::endl;
+    abort = true;
+  } else if (options.ramp != "none" && !RateLimiter::enabled()) {
+    std::cerr << "A ramp needs a throughput target." << std::endl;
+    std::cerr << "entity-generator --ramp=linear --target-entities-per-sec=N"
+              << std::endl;
+    abort = true;
+  }
+  if (!(options.rampSeconds > 0) ||
+      !(options.rampStart > 0 && options.rampStart <= 1) ||
+      options.rampSteps < 1) {
+    std::cerr << "Ramps need --ramp-seconds > 0, 0 < --ramp-start <= 1 and "
+                 "--ramp-steps >= 1"
+              << std::endl;
+    abort = true;
+  }
+
+  LogLevel logLevel;
+  bool logJson;
+  if (!parseLogLevel(options.logLevel, logLevel)) {
+    std::cerr << "Unknown log level: " << options.logLevel << std::endl;
+    std::cerr << "entity-generator --log-level=debug|info|warn|error"
+              << std::endl;
+    abort = true;
+  }
+  if (!parseLogFormat(options.logFormat, logJson)) {
+    std::cerr << "Unknown log format: " << options.logFormat << std::endl;
+    std::cerr << "entity-generator --log-format=text|json" << std::endl;
+    abort = true;
+  }
+
+  if (options.metricsInterval < 0) {
+    std::cerr << "--metrics-interval must not be negative" << std::endl;
+    abort = true;
+  }
+  if (options.metricsPort < 0 || options.metricsPort > 65535) {
+    std::cerr << "--metrics-port must be between 0 and 65535" << std::endl;
+    abort = true;
+  }
+
+  if (options.baseUrl.empty()) {
+    options.baseUrl = "https://" + options.hostname;
+  } else if (options.baseUrl.compare(0, 7, "http://") != 0 &&
+             options.baseUrl.compare(0, 8, "https://") != 0) {
+    std::cerr << "Unsupported base URL: " << options.baseUrl << std::endl;
+    std::cerr << "entity-generator --base-url=http[s]://HOST[:PORT][/PREFIX]"
+              << std::endl;
+    abort = true;
+  }
+  while (!options.baseUrl.empty() && *options.baseUrl.rbegin() == '/') {
+    options.baseUrl.erase(options.baseUrl.size() - 1);
+  }
+
+  if (options.serializer != "sax" && options.serializer != "dom") {
+    std::cerr << "Unknown serializer: " << options.serializer << std::endl;
+    std::cerr << "entity-generator --serializer=sax|dom" << std::endl;
+    abort = true;
+  }
+
+  if (options.maxBatchEntities < 0) {
+    std::cerr << "--max-batch-entities must not be negative" << std::endl;
+    abort = true;
+  }
+  if ((options.maxBatchBytes > 0 || options.maxBatchEntities > 0) &&
+      options.serializer != "sax") {
+    std::cerr << "Only the SAX serializer splits ticks into batches."
+              << std::endl;
+    std::cerr << "entity-generator --max-batch-bytes=N --serializer=sax"
+              << std::endl;
+    abort = true;
+  }
+
+  if (options.pipelineDepth < 0) {
+    std::cerr << "--pipeline-depth must not be negative" << std::endl;
+    abort = true;
+  }
+
+  if (options.maxInFlight < 1) {
+    std::cerr << "--max-in-flight must be at least 1" << std::endl;
+    abort = true;
+  } else if (options.maxInFlight > 1 && options.pipelineDepth == 0 &&
+             options.replay.empty()) {
+    std::cerr << "Concurrent uploads need the pipelined mode or a replay."
+              << std::endl;
+    std::cerr << "entity-generator --max-in-flight=N --pipeline-depth=M"
+              << std::endl;
+    abort = true;
+  }
+
+  if (options.maxRetries < 0) {
+    std::cerr << "--max-retries must not be negative" << std::endl;
+    abort = true;
+  }
+  if (options.retryInitialMs < 1 ||
+      options.retryMaxMs < options.retryInitialMs) {
+    std::cerr << "Retry backoffs must satisfy 1 <= --retry-initial-ms "
+                 "<= --retry-max-ms"
+              << std::endl;
+    abort = true;
+  }
+
+  if (options.jobPollInitialMs < 1 ||
+      options.jobPollMaxMs < options.jobPollInitialMs) {
+    std::cerr << "Job poll intervals must satisfy 1 <= --job-poll-initial-ms "
+                 "<= --job-poll-max-ms"
+              << std::endl;
+    abort = true;
+  }
+
+  if (options.rng != "mt19937" && options.rng != "stream" &&
+      options.rng != "philox") {
+    std::cerr << "Unknown random number source: " << options.rng << std::endl;
+    std::cerr << "entity-generator --rng=mt19937|stream|philox" << std::endl;
+    abort = true;
+  }
+  if (options.threads < 1) {
+    std::cerr << "--threads must be at least 1" << std::endl;
+    abort = true;
+  } else if (options.threads > 1 && options.rng == "mt19937") {
+    std::cerr << "The shared mt19937 walk cannot be split between threads."
+              << std::endl;
+    std::cerr << "entity-generator --threads=N --rng=stream|philox"
+              << std::endl;
+    abort = true;
+  }
+
+  if (options.compress != "none" &&
+      !PayloadCompressor::supported(options.compress)) {
+    std::cerr << "Unknown or unsupported compression: " << options.compress
+              << std::endl;
+    std::cerr << "entity-generator --compress=none|gzip|deflate|zstd"
+              << std::endl;
+    abort = true;
+  }
+
+  WalkKernel kernel;
+  if (!parseWalkKernel(options.simd, kernel)) {
+    std::cerr << "Unknown or unsupported --simd kernel: " << options.simd
+              << std::endl;
+    std::cerr << "entity-generator --simd=auto|avx2|sse2|scalar" << std::endl;
+    abort = true;
+  }
+
+  if (abort) {
+    exit(1);
+  }
+  configureLog(logLevel, logJson);
+
+  // Unless told otherwise, split ticks into bodies of about a twentieth of a
+  // second's worth of the targets, so the rate limiter can release them
+  // smoothly
+  if (RateLimiter::enabled() && options.serializer == "sax" &&
+      options.maxBatchBytes == 0 && options.maxBatchEntities == 0) {
+    if (options.targetEntitiesPerSec > 0) {
+      options.maxBatchEntities = std::max(
+          1, static_cast<int>(options.targetEntitiesPerSec /
+                              RATE_BATCHES_PER_SECOND));
+    } else {
+      options.maxBatchBytes = static_cast<uint64_t>(
+          options.targetBytesPerSec / RATE_BATCHES_PER_SECOND);
     }
   }
 }
 
 int main(int argc, char *argv[]) {
 
-  parseCommandLine(argc, argv);
-  std::string CONDUCE_ADD_DATA_URL =
-      "https://" + options.hostname + "/conduce/api/v1/datasets/add-data/";
-  std::string addDataUrl = CONDUCE_ADD_DATA_URL + options.dataset;
-  CURL *curl = curl_easy_init();
-  char errorBuffer[CURL_ERROR_SIZE];
-  std::string s;
-  std::map<std::string, std::string> headers;
-  struct curl_slist *entityHeader = NULL;
-  if (curl) {
-    curl_easy_setopt(curl, CURLOPT_URL, addDataUrl.c_str());
-    entityHeader =
-        curl_slist_append(entityHeader, "Content-Type: application/json");
-    std::string keyHeader = "Authorization: Bearer " + options.apiKey;
-    entityHeader = curl_slist_append(entityHeader, keyHeader.c_str());
-    entityHeader = curl_slist_append(entityHeader, "Expect:");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, entityHeader);
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
-    if (options.insecure) {
-      curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    }
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s);
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerfunc);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
-    if (options.disableSslVerifyPeer) {
-      curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    }
-    if (const char *cainfo = std::getenv("REQUESTS_CA_BUNDLE")) {
-      curl_easy_setopt(curl, CURLOPT_CAINFO, cainfo);
+  std::vector<std::string> workerArgs;
+  parseCommandLine(argc, argv, workerArgs);
+
+  if (options.shards > 0) {
+    return runShards(workerArgs, options.startTick, updateCount());
+  }
+  // Reports to a --shards coordinator until main returns
+  ShardProgress progress;
+
+  // Up before the entities are, so a scrape can watch a long initialization
+  MetricsEndpoint endpoint;
+  if (options.metricsPort > 0 &&
+      !endpoint.start(options.metricsAddress, options.metricsPort)) {
+    exit(1);
+  }
+
+  if (!options.replay.empty()) {
+    replay();
+    return 0;
+  }
+
+  std::unique_ptr<Checkpointer> checkpointer;
+  if (!options.checkpoint.empty()) {
+    checkpointer.reset(new Checkpointer);
+    if (!checkpointer->open()) {
+      exit(1);
     }
   }
+  const bool resuming = checkpointer && checkpointer->resumable();
+
+  if (!resuming) {
+    std::chrono::steady_clock::time_point initStart =
+        std::chrono::steady_clock::now();
+    initializeEntities();
+    std::chrono::duration<double, std::milli> initMs =
+        std::chrono::steady_clock::now() - initStart;
+    LOG(LOG_INFO) << "Initialized " << entities.size() << " entities in "
+                  << initMs.count() << " ms, peak RSS " << peakRssKb() / 1024
+                  << " MiB";
+  }
 
-  initializeEntities();
+  MetricsReporter reporter;
+  reporter.start();
 
   boost::mt19937 alg_walk(0);
   boost::random::uniform_real_distribution<> walk_range(-1 * options.stepSize,
                                                         options.stepSize);
 
   random_generator walk(alg_walk, walk_range);
+  if (resuming && !checkpointer->restore(walk)) {
+    exit(1);
+  }
 
-  const int UPDATE_COUNT = 3600 * 24 * options.daysToRun / options.timeInterval;
-  const int START_TIME = nowUTC();
-  int updateTime = START_TIME;
-  for (int count = 0; count < UPDATE_COUNT; ++count) {
-    s = std::string();
-    headers.clear();
-    const std::string entitiesStr = updateEntities(walk);
-    if (strlen(entitiesStr.c_str()) == 0) {
-      std::cout << getTimeString() << ": Zero length string" << std::endl;
-      continue;
+  std::unique_ptr<FileSink> sink;
+  if (!options.output.empty()) {
+    sink.reset(new FileSink);
+    if (!sink->open()) {
+      exit(1);
     }
-    std::cout << getTimeString() << ": " << addDataUrl << std::endl;
-    // Reset all of the curl fields for the next add_data call
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
-    curl_easy_setopt(curl, CURLOPT_URL, addDataUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, entitiesStr.c_str());
-    curl_easy_setopt(curl, CURLOPT_POST, 1);
-
-    CURLcode res;
-    errorBuffer[0] = 0;
-
-    res = curl_easy_perform(curl);
-    while (res != CURLE_OK) {
-      long responseCode = 0;
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode);
-      std::cout << getTimeString() << ": libcurl: " << res << std::endl;
-      std::cout << getTimeString() << responseCode << ": " << errorBuffer
-                << std::endl;
-      if (responseCode / 100 == 5) {
-        res = curl_easy_perform(curl);
-      } else {
-        break;
+  }
+
+  if (!resuming && options.startTick > 0) {
+    std::chrono::steady_clock::time_point seekStart =
+        std::chrono::steady_clock::now();
+    seekEntities(walk, options.startTick);
+    std::chrono::duration<double, std::milli> seekMs =
+        std::chrono::steady_clock::now() - seekStart;
+    LOG(LOG_INFO) << "Advanced " << entities.size() << " entities to tick "
+                  << entities.ticks << " in " << seekMs.count() << " ms";
+  }
+
+  const int UPDATE_COUNT = updateCount();
+  if (options.pipelineDepth > 0) {
+    runPipeline(walk, UPDATE_COUNT, options.pipelineDepth, sink.get());
+    if (sink) {
+      if (!sink->close()) {
+        exit(1);
       }
+      sink->report();
     }
-    // std::cout << "request data: " << entitiesStr.c_str() << std::endl;
-    // delete[] entitiesStr;
-    // The location header contains the URI to query for status updates for the
-    // asyncrhonous job
-    /*for (auto it = headers.begin(); it != headers.end(); ++it) {
-      std::cout << it->first + ": " + it->second << std::endl;
-    }*/
-    if (headers.find("Location") == headers.end()) {
-      std::cout << getTimeString() << ": No Location header found in response"
-                << std::endl;
+    reporter.stop();
+    return 0;
+  }
+
+  if (sink) {
+    writeEntities(walk, UPDATE_COUNT, *sink);
+    reporter.stop();
+    return 0;
+  }
+  if (!options.record.empty()) {
+    recordEntities(walk, UPDATE_COUNT);
+    reporter.stop();
+    return 0;
+  }
+
+  UploadHandle handle;
+  initUploadHandle(handle);
+  JobTracker tracker;
+
+  TickScheduler scheduler;
+  RateLimiter limiter;
+  // Reused for every tick so that steady-state ticks do not allocate
+  PayloadBuffer entitiesBuffer;
+  // A resumed run picks up after the last checkpointed tick, and a seek at
+  // --start-tick
+  for (int count = static_cast<int>(entities.ticks); count < UPDATE_COUNT;
+       ++count) {
+    updateEntities(walk, entitiesBuffer);
+    if (entitiesBuffer.size() == 0) {
+      LOG(LOG_WARN) << "Zero length string";
       continue;
     }
-    waitForCompletion(headers["Location"], curl);
-
-    if (!options.ungoverned) {
-      updateTime += options.timeInterval * 1000;
-      int sleepTime = updateTime - nowUTC();
-      ;
-      if (sleepTime > 0) {
-        std::cout << getTimeString() << ": Sleeping for " << sleepTime
-                  << " milliseconds" << std::endl;
-        usleep(sleepTime * 1000);
-      } else {
-        std::cout << getTimeString() << ": Behind real-time by " << sleepTime
-                  << " milliseconds" << std::endl;
+    // Bodies are sent one after another; their jobs are followed together
+    const char *body = entitiesBuffer.data();
+    for (size_t c = 0; c < entitiesBuffer.chunkCount(); ++c) {
+      if (RateLimiter::enabled()) {
+        limiter.acquire(entitiesBuffer.chunkEntities[c],
+                        entitiesBuffer.chunkSize(c));
       }
+      std::string jobUri;
+      if (postEntities(handle, body + entitiesBuffer.chunkBegin(c),
+                       entitiesBuffer.chunkSize(c), jobUri)) {
+        metrics.add(COUNTER_ENTITIES, entitiesBuffer.chunkEntities[c]);
+        metrics.add(COUNTER_BYTES, entitiesBuffer.chunkSize(c));
+        tracker.track(jobUri, []() {});
+      }
+    }
+    tracker.drain();
+    if (checkpointer) {
+      checkpointer->tickAcknowledged(walk, count + 1 == UPDATE_COUNT);
     }
+
+    scheduler.waitForNextTick();
+  }
+  if (checkpointer) {
+    checkpointer->finish();
+    checkpointer->report();
   }
 
-  curl_easy_cleanup(curl);
+  scheduler.report();
+  if (RateLimiter::enabled()) {
+    limiter.report();
+  }
+  tracker.report();
+  reporter.stop();
+  cleanupUploadHandle(handle);
   return 0;
 }
@@ -0,0 +1,296 @@
+#include "entity.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#include <sys/resource.h>
+
+#include <boost/date_time/gregorian/gregorian_types.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "rapidjson/internal/itoa.h"
+
+#include "log.h"
+#include "pacing.h"
+#include "walk-kernel.h"
+#include "worker-pool.h"
+
+EntityStore entities;
+CommandLineOptions options;
+
+boost::mt19937 alg_start_lat(1);
+boost::random::uniform_real_distribution<> start_lat_range(24., 49.);
+random_generator start_lat(alg_start_lat, start_lat_range);
+
+boost::mt19937 alg_start_lon(2);
+boost::random::uniform_real_distribution<> start_lon_range(-125., -66.);
+random_generator start_lon(alg_start_lon, start_lon_range);
+
+void EntityStore::resize(size_t count) {
+  longitude.resize(count);
+  latitude.resize(count);
+  altitude.resize(count);
+  initialLongitude.resize(count);
+  initialLatitude.resize(count);
+  timestamp.resize(count);
+  kindIndex.resize(count);
+  walkState.resize(count);
+}
+
+void EntityStore::snapshot(const EntityStore &source) {
+  longitude = source.longitude;
+  latitude = source.latitude;
+  altitude = source.altitude;
+  timestamp = source.timestamp;
+  kindIndex = source.kindIndex;
+  kinds = source.kinds;
+}
+
+size_t EntityStore::bytesPerEntity() {
+  return 5 * sizeof(double) + sizeof(uint64_t) + sizeof(uint16_t) +
+         sizeof(uint64_t);
+}
+
+size_t formatEntityId(size_t index, char *buffer) {
+  static const char PREFIX[] = "live-test-";
+  memcpy(buffer, PREFIX, sizeof(PREFIX) - 1);
+  char *end =
+      rapidjson::internal::u64toa(index, buffer + sizeof(PREFIX) - 1);
+  *end = '\0';
+  return end - buffer;
+}
+
+const double getStartDate() {
+  static boost::posix_time::ptime date(boost::gregorian::date(1996, 1, 1));
+  static boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+  return (date - epoch).total_milliseconds();
+}
+
+const long long nowUTC() {
+  static boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+  boost::posix_time::ptime now =
+      boost::posix_time::microsec_clock::universal_time();
+
+  return (now - epoch).total_milliseconds();
+}
+
+long peakRssKb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_maxrss;
+}
+
+const std::string getTimeString() {
+  char buffer[16];
+  formatTimeString(time(NULL), buffer);
+  return buffer;
+}
+
+void moveToNextTestLocation(double &lng, double &lat, const double initialLng,
+                            const double initialLat) {
+  if (lng == initialLng && lat == initialLat) {
+    lng = initialLng + options.stepSize;
+  } else if (lng == initialLng + options.stepSize && lat == initialLat) {
+    lat = initialLat + options.stepSize;
+  } else if (lng == initialLng + options.stepSize &&
+             lat == initialLat + options.stepSize) {
+    lng = initialLng;
+  } else if (lng == initialLng && lat == initialLat + options.stepSize) {
+    lat = initialLat;
+  } else {
+    lat = initialLat;
+    lng = initialLng;
+  }
+}
+
+std::array<double, 3> getGridLocation(int index, int entityCount) {
+  int side = ceil(sqrt(static_cast<double>(entityCount)));
+  int row = index / side;
+  int col = index % side;
+  return {{static_cast<double>(col) * options.stepSize * 3,
+           static_cast<double>(row) * options.stepSize * 3, 0}};
+}
+
+std::array<double, 3> getPhiloxStartLocation(uint64_t index) {
+  uint64_t lngBits, latBits;
+  philox::block(options.seed, index, philox::START_TICK, lngBits, latBits);
+  return {{uniformDouble(lngBits, start_lon_range.a(), start_lon_range.b()),
+           uniformDouble(latBits, start_lat_range.a(), start_lat_range.b()),
+           0.}};
+}
+
+WorkerPool &workerPool() {
+  static std::unique_ptr<WorkerPool> pool;
+  if (!pool || pool->size() != options.threads) {
+    pool.reset(new WorkerPool(options.threads));
+  }
+  return *pool;
+}
+
+void initializeEntities() {
+  const size_t count = options.entityCount;
+  entities.kinds.assign(1, options.kind);
+  entities.ticks = 0;
+  entities.resize(count);
+
+  // The shared mt19937 start generators have to be drawn in entity order;
+  // every other start location depends only on the entity's index.
+  const bool drawnStart = !options.testPattern && !options.centerStart &&
+                          options.rng != "philox";
+  if (drawnStart) {
+    for (size_t i = 0; i < count; ++i) {
+      entities.longitude[i] = start_lon();
+      entities.latitude[i] = start_lat();
+    }
+  }
+
+  const uint64_t startTime = options.live ? nowUTC() : options.startTime;
+  workerPool().run(count, [drawnStart, startTime](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      std::array<double, 3> location;
+      if (options.testPattern) {
+        location = getGridLocation(i, options.entityCount);
+      } else if (options.centerStart) {
+        location = CENTER_OF_US;
+      } else if (drawnStart) {
+        location = {{entities.longitude[i], entities.latitude[i], 0.}};
+      } else {
+        location = getPhiloxStartLocation(i);
+      }
+      entities.longitude[i] = location[0];
+      entities.latitude[i] = location[1];
+      entities.altitude[i] = location[2];
+      entities.initialLongitude[i] = location[0];
+      entities.initialLatitude[i] = location[1];
+      entities.timestamp[i] = startTime;
+      entities.kindIndex[i] = 0;
+      entities.walkState[i] = EntityWalk::seedFor(options.seed, i);
+    }
+  });
+}
+
+namespace {
+
+// Entities are moved in chunks small enough for their deltas to stay in L1
+const size_t WALK_CHUNK = 1024;
+
+void updateTimestamps(size_t begin, size_t end) {
+  if (options.live) {
+    for (size_t i = begin; i < end; ++i) {
+      entities.timestamp[i] = nowUTC();
+    }
+  } else {
+    for (size_t i = begin; i < end; ++i) {
+      entities.timestamp[i] += timeIntervalMs();
+    }
+  }
+}
+
+// Moves entities [begin, end) one tick.  Deltas come from walk if provided,
+// in the same order the per-entity loop drew them, and otherwise from each
+// entity's own stream or its Philox block for this tick.
+void walkEntities(size_t begin, size_t end, random_generator *walk,
+                  WalkKernel kernel) {
+  double dLat[WALK_CHUNK];
+  double dLng[WALK_CHUNK];
+  for (size_t chunk = begin; chunk < end; chunk += WALK_CHUNK) {
+    size_t count = std::min(WALK_CHUNK, end - chunk);
+    if (walk) {
+      for (size_t i = 0; i < count; ++i) {
+        dLat[i] = (*walk)();
+        dLng[i] = (*walk)();
+      }
+    } else if (options.rng == "philox") {
+      drawPhiloxDeltas(kernel, options.seed, entities.ticks, chunk, dLat, dLng,
+                       count, -1 * options.stepSize, options.stepSize);
+    } else {
+      drawStreamDeltas(kernel, &entities.walkState[chunk], dLat, dLng, count,
+                       -1 * options.stepSize, options.stepSize);
+    }
+    applyWalk(kernel, &entities.longitude[chunk], &entities.latitude[chunk],
+              dLat, dLng, count, options.marchWest, options.stepSize);
+  }
+  updateTimestamps(begin, end);
+}
+
+// Moves every entity and updates its timestamp for the current tick
+void stepWalk(random_generator &walk) {
+  if (options.testPattern) {
+    for (size_t i = 0; i < entities.size(); ++i) {
+      updateLocation(entities, i, walk);
+    }
+    updateTimestamps(0, entities.size());
+    return;
+  }
+
+  WalkKernel kernel = walkKernel();
+  if (options.rng != "mt19937") {
+    workerPool().run(entities.size(), [kernel](size_t begin, size_t end) {
+      walkEntities(begin, end, NULL, kernel);
+    });
+    return;
+  }
+  walkEntities(0, entities.size(), &walk, kernel);
+}
+
+} // namespace
+
+void stepEntities(random_generator &walk) {
+  stepWalk(walk);
+  ++entities.ticks;
+}
+
+void seekEntities(random_generator &walk, uint64_t tick) {
+  if (tick <= entities.ticks) {
+    return;
+  }
+  // The shared mt19937 walk has to be drawn tick by tick in entity order, and
+  // the test pattern is not a walk at all
+  if (options.rng == "mt19937" || options.testPattern) {
+    while (entities.ticks < tick) {
+      stepEntities(walk);
+    }
+    return;
+  }
+
+  // Each chunk of entities is taken through every tick while it is in L1,
+  // with the same kernels and in the same order as stepEntities(), so the
+  // positions are bit-identical to stepping tick by tick
+  const uint64_t first = entities.ticks;
+  const bool philox = options.rng == "philox";
+  WalkKernel kernel = walkKernel();
+  workerPool().run(
+      entities.size(), [first, tick, philox, kernel](size_t begin,
+                                                     size_t end) {
+        double dLat[WALK_CHUNK];
+        double dLng[WALK_CHUNK];
+        for (size_t chunk = begin; chunk < end; chunk += WALK_CHUNK) {
+          size_t count = std::min(WALK_CHUNK, end - chunk);
+          for (uint64_t t = first; t < tick; ++t) {
+            if (philox) {
+              drawPhiloxDeltas(kernel, options.seed, t, chunk, dLat, dLng,
+                               count, -1 * options.stepSize,
+                               options.stepSize);
+            } else {
+              drawStreamDeltas(kernel, &entities.walkState[chunk], dLat, dLng,
+                               count, -1 * options.stepSize,
+                               options.stepSize);
+            }
+            applyWalk(kernel, &entities.longitude[chunk],
+                      &entities.latitude[chunk], dLat, dLng, count,
+                      options.marchWest, options.stepSize);
+          }
+        }
+        // Non-live timestamps advance by a fixed step, so they jump straight
+        // to the target
+        for (size_t i = begin; i < end; ++i) {
+          entities.timestamp[i] += (tick - first) * timeIntervalMs();
+        }
+      });
+  entities.ticks = tick;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rng.h"
+
+const std::array<double, 3> CENTER_OF_US = {{-98.5795, 39.8282, 0.}};
+
+struct CommandLineOptions {
+  bool initialize = true;
+  double timeInterval = 1;
+  int entityCount = 100;
+  bool centerStart = false;
+  double stepSize = 0.1;
+  bool marchWest = false;
+  bool live = false;
+  bool ungoverned = false;
+  std::string behind;
+  // Throughput targets for add-data bodies; 0 for none
+  double targetEntitiesPerSec = 0;
+  double targetBytesPerSec = 0;
+  std::string ramp;
+  double rampSeconds = 60;
+  double rampStart = 0.1;
+  int rampSteps = 5;
+  double metricsInterval = 10;
+  // Port for the Prometheus endpoint; 0 for none
+  int metricsPort = 0;
+  std::string metricsAddress;
+  std::string logLevel;
+  std::string logFormat;
+  int daysToRun = 1;
+  // The ticks to produce, [startTick, endTick); endTick 0 runs to the end of
+  // --days
+  int startTick = 0;
+  int endTick = 0;
+  uint64_t startTime = 0;
+  uint64_t endtimeOffset = 0;
+  std::string hostname;
+  // Scheme, authority and optional path prefix of the Conduce API; defaults
+  // to https://<hostname>
+  std::string baseUrl;
+  std::string unixSocket;
+  // file:// URL to write bodies to instead of POSTing them; empty to POST
+  std::string output;
+  std::string outputFormat;
+  uint64_t outputRotateBytes = 0;
+  bool outputDirect = false;
+  // Recording to write instead of sending, or to send instead of simulating
+  std::string record;
+  std::string replay;
+  double replaySpeed = 1;
+  bool replayRebase = false;
+  std::string checkpoint;
+  double checkpointInterval = 60;
+  bool resume = false;
+  // Worker processes to split the ticks between; 0 runs in this process
+  int shards = 0;
+  int shardRetries = 2;
+  // Pipe a shard worker reports its progress to; -1 outside a shard
+  int progressFd = -1;
+  std::string dataset;
+  std::string apiKey;
+  std::string kind;
+  std::string serializer;
+  int pipelineDepth = 0;
+  int maxInFlight = 1;
+  // Retries of an add-data POST answered with a 5xx, and the backoff
+  // between them
+  int maxRetries = 5;
+  int retryInitialMs = 100;
+  int retryMaxMs = 10000;
+  int jobPollInitialMs = 5;
+  int jobPollMaxMs = 1000;
+  int threads = 1;
+  std::string rng;
+  uint64_t seed = 0;
+  std::string simd;
+  std::string compress;
+  int compressLevel = 0;
+  uint64_t maxBatchBytes = 0;
+  int maxBatchEntities = 0;
+  bool insecure = false;
+  bool testPattern = false;
+  bool disableSslVerifyPeer = false;
+};
+
+// Every entity's state, stored as one contiguous array per field so the
+// per-tick update streams through just the coordinates it touches.  Entity
+// ids are not stored; entity i is always "live-test-<i>".  Kinds are interned:
+// each entity holds an index into kinds.
+struct EntityStore {
+  std::vector<double> longitude;
+  std::vector<double> latitude;
+  std::vector<double> altitude;
+  std::vector<double> initialLongitude;
+  std::vector<double> initialLatitude;
+  std::vector<uint64_t> timestamp;
+  std::vector<uint16_t> kindIndex;
+  // State of each entity's own random walk stream (--rng=stream)
+  std::vector<uint64_t> walkState;
+  std::vector<std::string> kinds;
+  // Ticks stepped since initializeEntities(); the --rng=philox counter
+  uint64_t ticks = 0;
+
+  size_t size() const { return longitude.size(); }
+  void resize(size_t count);
+
+  // Copies the fields the serializers read (current location, timestamp and
+  // kind) from source, reusing this store's storage.
+  void snapshot(const EntityStore &source);
+
+  // Bytes of per-entity storage
+  static size_t bytesPerEntity();
+};
+
+// Longest id produced by formatEntityId(), including the terminator
+const size_t MAX_ENTITY_ID_LENGTH = 32;
+
+// Writes entity index's id ("live-test-<index>") to buffer, which must hold
+// MAX_ENTITY_ID_LENGTH characters.  Returns the id's length.
+size_t formatEntityId(size_t index, char *buffer);
+
+extern EntityStore entities;
+extern CommandLineOptions options;
+
+const double getStartDate();
+const long long nowUTC();
+const std::string getTimeString();
+// The process's peak resident set size so far, in KiB
+long peakRssKb();
+
+void moveToNextTestLocation(double &lng, double &lat, const double initialLng,
+                            const double initialLat);
+
+template <typename Walk>
+void updateLocation(EntityStore &store, size_t index, Walk &walk) {
+  double lng = store.longitude[index];
+  double lat = store.latitude[index];
+  double newLat = lat;
+  double newLng = lng;
+
+  if (options.testPattern) {
+    moveToNextTestLocation(newLng, newLat, store.initialLongitude[index],
+                           store.initialLatitude[index]);
+  } else {
+    newLat += walk();
+    newLng += walk();
+    if (options.marchWest) {
+      newLng = lng - options.stepSize;
+    }
+
+    if (lng > -180 && newLng < -180) {
+      newLng += 360;
+    } else if (lng < 180 and newLng > 180) {
+      newLng -= 360;
+    }
+    if (lat > -90 && newLat < -90) {
+      newLat += 180;
+    } else if (lat < 90 and newLat > 90) {
+      newLat -= 180;
+    }
+  }
+
+  store.longitude[index] = newLng;
+  store.latitude[index] = newLat;
+}
+
+std::array<double, 3> getGridLocation(int index, int entityCount);
+// Entity index's start location under --rng=philox
+std::array<double, 3> getPhiloxStartLocation(uint64_t index);
+class WorkerPool;
+
+// The --threads threads that per-entity work is split across, created on
+// first use and again whenever --threads changes
+WorkerPool &workerPool();
+
+// Sizes entities for --entity-count and places every entity at its start
+// location.  Everything but the mt19937 start draws is split across
+// --threads threads.
+void initializeEntities();
+
+// Advances every entity in entities by one time interval: moves it and
+// updates its timestamp.  With --rng=stream or --rng=philox each entity draws
+// from its own stream and the work is split across --threads threads;
+// otherwise every entity draws from walk in turn.  The walk runs on the
+// --simd kernel.
+void stepEntities(random_generator &walk);
+
+// Advances entities to tick without serializing anything on the way, leaving
+// them exactly as that many stepEntities() calls would (--start-tick).  Under
+// --rng=stream and --rng=philox each chunk of entities is walked through all
+// the ticks at once, split across --threads threads; under --rng=mt19937 the
+// ticks are stepped one by one.  Not for --live, whose timestamps come from
+// the clock.
+void seekEntities(random_generator &walk, uint64_t tick);
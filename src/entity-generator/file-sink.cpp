@@ -0,0 +1,202 @@
+#include "file-sink.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "entity.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace {
+
+const char FILE_SCHEME[] = "file://";
+
+// O_DIRECT needs buffers, offsets and lengths aligned to the logical block
+// size; 4 KiB covers the devices we write to
+const size_t DIRECT_ALIGNMENT = 4096;
+const size_t BUFFER_SIZE = 8 * 1024 * 1024;
+
+// Rotated files are numbered with at least this many digits, so they sort
+const int FILE_INDEX_DIGITS = 6;
+
+} // namespace
+
+FileSink::FileSink()
+    : fd_(-1), direct_(false), buffer_(NULL), used_(0), fileBytes_(0),
+      totalBytes_(0), files_(0) {}
+
+FileSink::~FileSink() {
+  if (fd_ >= 0) {
+    close();
+  }
+  free(buffer_);
+}
+
+bool FileSink::parseUrl(const std::string &url, std::string &path) {
+  if (url.compare(0, sizeof(FILE_SCHEME) - 1, FILE_SCHEME) != 0 ||
+      url.size() == sizeof(FILE_SCHEME) - 1) {
+    return false;
+  }
+  path = url.substr(sizeof(FILE_SCHEME) - 1);
+  return true;
+}
+
+bool FileSink::open() {
+  if (!parseUrl(options.output, path_)) {
+    LOG(LOG_ERROR) << "Not a file URL: " << options.output;
+    return false;
+  }
+  if (!buffer_ &&
+      posix_memalign(reinterpret_cast<void **>(&buffer_), DIRECT_ALIGNMENT,
+                     BUFFER_SIZE) != 0) {
+    buffer_ = NULL;
+    LOG(LOG_ERROR) << "Unable to allocate the output buffer";
+    return false;
+  }
+
+  separator_.clear();
+  if (options.outputFormat == "ndjson") {
+    if (options.compress == "none") {
+      separator_ = "\n";
+    } else {
+      PayloadCompressor compressor(options.compress, options.compressLevel);
+      rapidjson::StringBuffer newline;
+      compressor.begin(newline);
+      compressor.Put('\n');
+      compressor.end();
+      separator_.assign(newline.GetString(), newline.GetSize());
+    }
+  }
+  return openFile();
+}
+
+bool FileSink::write(const char *body, size_t size) {
+  PhaseTimer timer(PHASE_WRITE);
+  const size_t bytes = size + separator_.size();
+  if (options.outputRotateBytes > 0 && fileBytes_ > 0 &&
+      fileBytes_ + bytes > options.outputRotateBytes) {
+    if (!close() || !openFile()) {
+      return false;
+    }
+  }
+  if (!append(body, size) ||
+      !append(separator_.data(), separator_.size())) {
+    return false;
+  }
+  fileBytes_ += bytes;
+  totalBytes_ += bytes;
+  return true;
+}
+
+bool FileSink::close() {
+  if (fd_ < 0) {
+    return true;
+  }
+  // The tail is unlikely to fill a block, so the aligned part goes out
+  // direct and the rest through the page cache
+  size_t aligned = direct_ ? used_ - used_ % DIRECT_ALIGNMENT : 0;
+  bool ok = writeAll(buffer_, aligned);
+  if (ok && direct_ && aligned < used_ &&
+      fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT) != 0) {
+    LOG(LOG_ERROR) << "Unable to clear O_DIRECT on " << fileName(files_ - 1)
+                   << ": " << strerror(errno);
+    ok = false;
+  }
+  ok = ok && writeAll(buffer_ + aligned, used_ - aligned);
+  used_ = 0;
+  if (::close(fd_) != 0 && ok) {
+    LOG(LOG_ERROR) << "Unable to close " << fileName(files_ - 1) << ": "
+                   << strerror(errno);
+    ok = false;
+  }
+  fd_ = -1;
+  return ok;
+}
+
+void FileSink::report() const {
+  LOG(LOG_INFO) << "Wrote " << totalBytes_ << " bytes to " << files_
+                << (files_ == 1 ? " file" : " files");
+}
+
+bool FileSink::openFile() {
+  const std::string name = fileName(files_);
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  direct_ = options.outputDirect;
+  fd_ = ::open(name.c_str(), flags | (direct_ ? O_DIRECT : 0), 0644);
+  if (fd_ < 0 && direct_ && errno == EINVAL) {
+    // tmpfs and some network filesystems refuse O_DIRECT
+    LOG(LOG_WARN) << name << " does not support O_DIRECT; writing through "
+                  << "the page cache";
+    direct_ = false;
+    fd_ = ::open(name.c_str(), flags, 0644);
+  }
+  if (fd_ < 0) {
+    LOG(LOG_ERROR) << "Unable to create " << name << ": " << strerror(errno);
+    return false;
+  }
+  LOG(LOG_DEBUG) << "Writing " << name;
+  ++files_;
+  fileBytes_ = 0;
+  return true;
+}
+
+bool FileSink::append(const char *data, size_t size) {
+  while (size > 0) {
+    size_t room = BUFFER_SIZE - used_;
+    size_t count = size < room ? size : room;
+    memcpy(buffer_ + used_, data, count);
+    used_ += count;
+    data += count;
+    size -= count;
+    if (used_ == BUFFER_SIZE && !flush()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FileSink::flush() {
+  bool ok = writeAll(buffer_, used_);
+  used_ = 0;
+  return ok;
+}
+
+bool FileSink::writeAll(const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(LOG_ERROR) << "Unable to write " << fileName(files_ - 1) << ": "
+                     << strerror(errno);
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+std::string FileSink::fileName(int index) const {
+  if (options.outputRotateBytes == 0) {
+    return path_;
+  }
+  // The number goes before the extensions: run.ndjson.gz becomes
+  // run-000000.ndjson.gz
+  char number[16];
+  snprintf(number, sizeof(number), "-%0*d", FILE_INDEX_DIGITS, index);
+  size_t slash = path_.rfind('/');
+  size_t base = slash == std::string::npos ? 0 : slash + 1;
+  size_t dot = path_.find('.', base);
+  if (dot == std::string::npos || dot == base) {
+    return path_ + number;
+  }
+  return path_.substr(0, dot) + number + path_.substr(dot);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Writes add-data bodies to local files for --output=file://PATH instead of
+// POSTing them.  Bodies are gathered in a large block-aligned buffer that is
+// written out whole, with O_DIRECT under --output-direct, so the page cache
+// and per-body syscalls stay out of the way of fast local disks.
+//
+// With --output-format=ndjson every body is followed by a newline; with json
+// the bodies are concatenated.  Under --compress the bodies are gzip members
+// or zstd frames, and the newline is compressed the same way, so the file
+// decompresses to the uncompressed form.  --output-rotate-bytes starts a new
+// file, numbered from 0, before a body would take the current one past that
+// size.
+class FileSink {
+public:
+  FileSink();
+  ~FileSink();
+
+  // The local path in a file:// URL.  Returns false if url is not one.
+  static bool parseUrl(const std::string &url, std::string &path);
+
+  // Creates the first file.  Returns false, after logging, on failure.
+  bool open();
+
+  // Appends size bytes of body, as serialized (and compressed).  Returns
+  // false, after logging, if the file cannot be written.
+  bool write(const char *body, size_t size);
+
+  // Writes out whatever is buffered and closes the current file.  Returns
+  // false, after logging, on failure.
+  bool close();
+
+  // Logs the files and bytes written
+  void report() const;
+
+private:
+  FileSink(const FileSink &);
+  FileSink &operator=(const FileSink &);
+
+  bool openFile();
+  bool append(const char *data, size_t size);
+  // Writes the full buffer
+  bool flush();
+  bool writeAll(const char *data, size_t size);
+  std::string fileName(int index) const;
+
+  std::string path_;
+  // What follows each body
+  std::string separator_;
+  int fd_;
+  bool direct_;
+  char *buffer_;
+  size_t used_;
+  // Bytes in the current file, including those still buffered
+  uint64_t fileBytes_;
+  uint64_t totalBytes_;
+  int files_;
+};
@@ -0,0 +1,376 @@
+#include "http-server.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#endif
+
+namespace {
+
+// Largest request head (request line and headers) accepted
+const size_t MAX_HEAD_SIZE = 64 * 1024;
+const size_t READ_SIZE = 64 * 1024;
+// How often the accept loop checks for stop()
+const int ACCEPT_POLL_MS = 100;
+
+const char *reason(int status) {
+  switch (status) {
+  case 100:
+    return "Continue";
+  case 200:
+    return "OK";
+  case 202:
+    return "Accepted";
+  case 400:
+    return "Bad Request";
+  case 401:
+    return "Unauthorized";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 411:
+    return "Length Required";
+  case 413:
+    return "Payload Too Large";
+  case 500:
+    return "Internal Server Error";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "Unknown";
+  }
+}
+
+std::string lowerCase(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
+}
+
+std::string trim(const std::string &s) {
+  size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  size_t end = s.find_last_not_of(" \t\r");
+  return s.substr(begin, end - begin + 1);
+}
+
+} // namespace
+
+// A client connection and the bytes read from it but not yet consumed
+struct HttpServer::Connection {
+  int fd = -1;
+#ifdef HAVE_OPENSSL
+  SSL *tls = NULL;
+#endif
+  std::string buffered;
+
+  ssize_t read(char *data, size_t size) {
+#ifdef HAVE_OPENSSL
+    if (tls) {
+      int result = SSL_read(tls, data, static_cast<int>(size));
+      return result > 0 ? result : -1;
+    }
+#endif
+    ssize_t result;
+    do {
+      result = ::recv(fd, data, size, 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+  }
+
+  bool write(const char *data, size_t size) {
+    while (size > 0) {
+      ssize_t written;
+#ifdef HAVE_OPENSSL
+      if (tls) {
+        written = SSL_write(tls, data, static_cast<int>(size));
+      } else
+#endif
+      {
+        written = ::send(fd, data, size, MSG_NOSIGNAL);
+      }
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  // Reads more bytes into buffered; false once the peer has gone
+  bool fill() {
+    char data[READ_SIZE];
+    ssize_t count = read(data, sizeof(data));
+    if (count <= 0) {
+      return false;
+    }
+    buffered.append(data, count);
+    return true;
+  }
+};
+
+const std::string &HttpRequest::header(const std::string &name) const {
+  static const std::string EMPTY;
+  std::map<std::string, std::string>::const_iterator it = headers.find(name);
+  return it == headers.end() ? EMPTY : it->second;
+}
+
+HttpServer::HttpServer(Handler handler)
+    : handler_(handler), listenFd_(-1), port_(0),
+#ifdef HAVE_OPENSSL
+      tls_(NULL),
+#endif
+      stopping_(false) {
+}
+
+HttpServer::~HttpServer() {
+  stop();
+#ifdef HAVE_OPENSSL
+  if (tls_) {
+    SSL_CTX_free(tls_);
+  }
+#endif
+}
+
+bool HttpServer::listenTcp(const std::string &address, int port) {
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    std::cerr << "Invalid listen address: " << address << std::endl;
+    return false;
+  }
+
+  listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(listenFd_, SOMAXCONN) != 0) {
+    std::cerr << "Unable to listen on " << address << ":" << port << ": "
+              << strerror(errno) << std::endl;
+    close(listenFd_);
+    listenFd_ = -1;
+    return false;
+  }
+
+  socklen_t length = sizeof(addr);
+  getsockname(listenFd_, reinterpret_cast<sockaddr *>(&addr), &length);
+  port_ = ntohs(addr.sin_port);
+  return true;
+}
+
+bool HttpServer::listenUnix(const std::string &path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Unix socket path too long: " << path << std::endl;
+    return false;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+
+  listenFd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(listenFd_, SOMAXCONN) != 0) {
+    std::cerr << "Unable to listen on " << path << ": " << strerror(errno)
+              << std::endl;
+    close(listenFd_);
+    listenFd_ = -1;
+    return false;
+  }
+  unixPath_ = path;
+  return true;
+}
+
+#ifdef HAVE_OPENSSL
+bool HttpServer::enableTls(const std::string &certFile,
+                           const std::string &keyFile) {
+  tls_ = SSL_CTX_new(TLS_server_method());
+  if (!tls_ ||
+      SSL_CTX_use_certificate_chain_file(tls_, certFile.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(tls_, keyFile.c_str(), SSL_FILETYPE_PEM) !=
+          1) {
+    char error[256];
+    ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+    std::cerr << "Unable to load TLS certificate: " << error << std::endl;
+    return false;
+  }
+  return true;
+}
+#endif
+
+void HttpServer::start() {
+  acceptor_ = std::thread(&HttpServer::acceptLoop, this);
+}
+
+void HttpServer::stop() {
+  if (stopping_.exchange(true)) {
+    return;
+  }
+  if (acceptor_.joinable()) {
+    acceptor_.join();
+  }
+  if (listenFd_ >= 0) {
+    close(listenFd_);
+    listenFd_ = -1;
+  }
+  if (!unixPath_.empty()) {
+    unlink(unixPath_.c_str());
+  }
+
+  // Wake every connection thread blocked in a read; each one removes itself
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (std::set<int>::iterator it = connections_.begin();
+       it != connections_.end(); ++it) {
+    shutdown(*it, SHUT_RDWR);
+  }
+  closed_.wait(lock, [this] { return connections_.empty(); });
+}
+
+void HttpServer::acceptLoop() {
+  pollfd listening = {listenFd_, POLLIN, 0};
+  while (!stopping_) {
+    if (poll(&listening, 1, ACCEPT_POLL_MS) <= 0) {
+      continue;
+    }
+    int fd = accept(listenFd_, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    if (unixPath_.empty()) {
+      int noDelay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.insert(fd);
+    std::thread(&HttpServer::serve, this, fd).detach();
+  }
+}
+
+void HttpServer::serve(int fd) {
+  Connection connection;
+  connection.fd = fd;
+  bool open = true;
+#ifdef HAVE_OPENSSL
+  if (tls_) {
+    connection.tls = SSL_new(tls_);
+    SSL_set_fd(connection.tls, fd);
+    open = SSL_accept(connection.tls) == 1;
+  }
+#endif
+
+  while (open && !stopping_) {
+    HttpRequest request;
+    if (!readRequest(connection, request)) {
+      break;
+    }
+    HttpResponse response;
+    handler_(request, response);
+    bool keepAlive = lowerCase(request.header("connection")) != "close";
+    if (!writeResponse(connection, response, keepAlive) || !keepAlive) {
+      break;
+    }
+  }
+
+#ifdef HAVE_OPENSSL
+  if (connection.tls) {
+    SSL_free(connection.tls);
+  }
+#endif
+  // Deregister before closing so stop() never shuts down a reused descriptor
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.erase(fd);
+    closed_.notify_all();
+  }
+  close(fd);
+}
+
+bool HttpServer::readRequest(Connection &connection, HttpRequest &request) {
+  size_t headEnd;
+  while ((headEnd = connection.buffered.find("\r\n\r\n")) ==
+         std::string::npos) {
+    if (connection.buffered.size() > MAX_HEAD_SIZE || !connection.fill()) {
+      return false;
+    }
+  }
+
+  std::istringstream head(connection.buffered.substr(0, headEnd));
+  connection.buffered.erase(0, headEnd + 4);
+  std::string line;
+  std::getline(head, line);
+  std::istringstream requestLine(line);
+  requestLine >> request.method >> request.target;
+  while (std::getline(head, line)) {
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+      request.headers[lowerCase(trim(line.substr(0, colon)))] =
+          trim(line.substr(colon + 1));
+    }
+  }
+
+  if (!request.header("transfer-encoding").empty()) {
+    HttpResponse response;
+    response.status = 411;
+    writeResponse(connection, response, false);
+    return false;
+  }
+  if (lowerCase(request.header("expect")) == "100-continue") {
+    static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!connection.write(CONTINUE, sizeof(CONTINUE) - 1)) {
+      return false;
+    }
+  }
+
+  size_t length = strtoull(request.header("content-length").c_str(), NULL, 10);
+  while (connection.buffered.size() < length) {
+    if (!connection.fill()) {
+      return false;
+    }
+  }
+  request.body.assign(connection.buffered, 0, length);
+  connection.buffered.erase(0, length);
+  return true;
+}
+
+bool HttpServer::writeResponse(Connection &connection,
+                               const HttpResponse &response, bool keepAlive) {
+  std::ostringstream head;
+  head << "HTTP/1.1 " << response.status << " " << reason(response.status)
+       << "\r\n";
+  for (size_t i = 0; i < response.headers.size(); ++i) {
+    head << response.headers[i].first << ": " << response.headers[i].second
+         << "\r\n";
+  }
+  head << "Content-Length: " << response.body.size() << "\r\n";
+  if (!keepAlive) {
+    head << "Connection: close\r\n";
+  }
+  head << "\r\n";
+  std::string text = head.str();
+  return connection.write(text.data(), text.size()) &&
+         connection.write(response.body.data(), response.body.size());
+}
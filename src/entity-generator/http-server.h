@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+struct HttpRequest {
+  std::string method;
+  std::string target;
+  // Header names are lower-cased
+  std::map<std::string, std::string> headers;
+  std::string body;
+
+  // The value of header name (lower case), or an empty string
+  const std::string &header(const std::string &name) const;
+};
+
+struct HttpResponse {
+  int status = 200;
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+// A small HTTP/1.1 server for local tooling: the mock ingest server and the
+// metrics endpoint.  Each connection gets its own thread and is kept alive
+// between requests.  Request bodies must carry a Content-Length.
+class HttpServer {
+public:
+  typedef std::function<void(const HttpRequest &, HttpResponse &)> Handler;
+
+  explicit HttpServer(Handler handler);
+  ~HttpServer();
+
+  // Listens on address:port, or on a Unix-domain socket at path.  Port 0
+  // picks a free port.  Returns false, after logging, on failure.
+  bool listenTcp(const std::string &address, int port);
+  bool listenUnix(const std::string &path);
+
+#ifdef HAVE_OPENSSL
+  // Serves HTTPS with the PEM certificate chain and key in the given files
+  bool enableTls(const std::string &certFile, const std::string &keyFile);
+#endif
+
+  // The port listenTcp() bound
+  int port() const { return port_; }
+
+  // Starts accepting connections on a background thread
+  void start();
+
+  // Stops accepting, closes every connection and waits for their threads
+  void stop();
+
+private:
+  HttpServer(const HttpServer &);
+  HttpServer &operator=(const HttpServer &);
+
+  struct Connection;
+
+  void acceptLoop();
+  void serve(int fd);
+  bool readRequest(Connection &connection, HttpRequest &request);
+  bool writeResponse(Connection &connection, const HttpResponse &response,
+                     bool keepAlive);
+
+  Handler handler_;
+  int listenFd_;
+  int port_;
+  std::string unixPath_;
+#ifdef HAVE_OPENSSL
+  SSL_CTX *tls_;
+#endif
+  std::thread acceptor_;
+  std::atomic<bool> stopping_;
+  std::mutex mutex_;
+  std::condition_variable closed_;
+  std::set<int> connections_;
+};
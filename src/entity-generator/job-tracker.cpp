@@ -0,0 +1,245 @@
+#include "job-tracker.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#include "entity.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace {
+
+// Upper bound on job status requests in flight at once
+const size_t MAX_CONCURRENT_POLLS = 16;
+
+double toMs(JobTracker::Clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+} // namespace
+
+JobTracker::JobTracker()
+    : multi_(curl_multi_init()), completed_(0), totalPolls_(0),
+      totalLatency_(0), maxLatency_(0) {
+  if (!multi_) {
+    std::cerr << "Unable to create libcurl multi handle" << std::endl;
+    exit(1);
+  }
+}
+
+JobTracker::~JobTracker() {
+  for (size_t i = 0; i < handles_.size(); ++i) {
+    if (handles_[i]->job) {
+      curl_multi_remove_handle(multi_, handles_[i]->handle.curl);
+    }
+    cleanupUploadHandle(handles_[i]->handle);
+  }
+  curl_multi_cleanup(multi_);
+}
+
+void JobTracker::track(const std::string &jobUri, Callback done) {
+  if (jobUri.empty()) {
+    done();
+    return;
+  }
+  LOG(LOG_DEBUG) << "Waiting for " << jobUri;
+
+  std::unique_ptr<Job> job(new Job);
+  job->url = getJobUrl(jobUri);
+  job->started = Clock::now();
+  job->nextPoll = job->started;
+  job->interval = std::chrono::milliseconds(options.jobPollInitialMs);
+  job->done = done;
+  jobs_.push_back(std::move(job));
+  metrics.adjust(GAUGE_PENDING_JOBS, 1);
+}
+
+void JobTracker::startPoll(Job *job) {
+  PollHandle *poll;
+  if (idle_.empty()) {
+    handles_.push_back(std::unique_ptr<PollHandle>(new PollHandle));
+    poll = handles_.back().get();
+    if (!initUploadHandle(poll->handle)) {
+      std::cerr << "Unable to create libcurl handle" << std::endl;
+      exit(1);
+    }
+    curl_easy_setopt(poll->handle.curl, CURLOPT_PRIVATE, poll);
+  } else {
+    poll = idle_.back();
+    idle_.pop_back();
+  }
+
+  // Reset various CURL fields that get modified by the add_data requests.
+  // Querying an asynchronous job status is a GET request so we want to hold
+  // on to the result data
+  CURL *curl = poll->handle.curl;
+  poll->handle.response.clear();
+  poll->handle.headers.clear();
+  poll->handle.errorBuffer[0] = 0;
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, poll->handle.errorBuffer);
+  curl_easy_setopt(curl, CURLOPT_URL, job->url.c_str());
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &poll->handle.response);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, 0);
+  curl_easy_setopt(curl, CURLOPT_POST, 0);
+  curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &poll->handle.headers);
+
+  poll->job = job;
+  job->polling = true;
+  ++job->polls;
+  ++totalPolls_;
+  metrics.add(COUNTER_JOB_POLLS);
+  curl_multi_add_handle(multi_, curl);
+}
+
+bool JobTracker::finishPoll(PollHandle *poll, CURLcode code) {
+  UploadHandle &handle = poll->handle;
+  if (code != CURLE_OK) {
+    // Whatever the error, the job gets polled again
+    LOG(LOG_WARN) << "libcurl: " << code << " polling a job: "
+                  << handle.errorBuffer;
+  }
+
+  long responseCode = 0;
+  curl_easy_getinfo(handle.curl, CURLINFO_RESPONSE_CODE, &responseCode);
+  // A successful query for an asynchronous job should yield a 200 response
+  // But sometimes asynchronous jobs can take a little long to update their
+  // status
+  //(Not likely in this program)
+  // Async job status is stored in redis with an expiration time of 5
+  // minutes.
+  // Every time the progress is updated, the 5 minute expiration is
+  // refreshed.
+  // If a job takes a really long time and the underlying code doesn't do a
+  // good job of
+  // keeping the progress updated, the redis key can vanish, causing the
+  // query for status to fail.
+  // Due to the asynchronous nature of the task, it is very difficult for
+  // the end user to tell if the job failed (likely due to a server bug)
+  // or if it just hasn't updated its progress and it's taking a long time
+  // (also a server bug, but a different kind)
+  // Given that, we'll just be extra safe and print a warning.  If the user
+  // sees nothing but warnings for a long time, it's probably a job failure.
+  // Note that if the job fails without killing the whole server process, it
+  // should finish and report a failing response status.
+  if (responseCode != 200) {
+    LOG(LOG_WARN) << "Warning: bad response code received: " << responseCode;
+    return false;
+  }
+
+  long jobResponse = 0;
+  std::string jobResult;
+  if (!parseJobStatus(handle.response.c_str(), jobResponse, jobResult)) {
+    return false;
+  }
+  if (jobResponse != 200) {
+    LOG(LOG_ERROR) << "add_data failed with code " << jobResponse << "\n\n"
+                   << jobResult;
+    exit(1);
+  }
+  return true;
+}
+
+void JobTracker::complete(Job *job) {
+  Clock::duration latency = Clock::now() - job->started;
+  ++completed_;
+  totalLatency_ += latency;
+  maxLatency_ = std::max(maxLatency_, latency);
+  metrics.record(PHASE_JOB, latency);
+  metrics.add(COUNTER_JOBS);
+  metrics.adjust(GAUGE_PENDING_JOBS, -1);
+
+  Callback done;
+  done.swap(job->done);
+  for (size_t i = 0; i < jobs_.size(); ++i) {
+    if (jobs_[i].get() == job) {
+      jobs_.erase(jobs_.begin() + i);
+      break;
+    }
+  }
+  done();
+}
+
+void JobTracker::poll(int timeoutMs) {
+  int running = 0;
+  curl_multi_perform(multi_, &running);
+
+  int queued = 0;
+  while (CURLMsg *message = curl_multi_info_read(multi_, &queued)) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    PollHandle *poll = NULL;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &poll);
+    CURLcode code = message->data.result;
+    curl_multi_remove_handle(multi_, poll->handle.curl);
+
+    Job *job = poll->job;
+    poll->job = NULL;
+    idle_.push_back(poll);
+    job->polling = false;
+    if (finishPoll(poll, code)) {
+      complete(job);
+    } else {
+      job->nextPoll = Clock::now() + job->interval;
+      job->interval = std::min<Clock::duration>(
+          job->interval * 2,
+          std::chrono::milliseconds(options.jobPollMaxMs));
+    }
+  }
+
+  // Start the polls that are due and work out when the next one will be
+  Clock::time_point now = Clock::now();
+  Clock::time_point wakeup = now + std::chrono::milliseconds(timeoutMs);
+  size_t active = handles_.size() - idle_.size();
+  for (size_t i = 0; i < jobs_.size(); ++i) {
+    Job *job = jobs_[i].get();
+    if (job->polling) {
+      continue;
+    }
+    if (job->nextPoll <= now) {
+      if (active < MAX_CONCURRENT_POLLS) {
+        startPoll(job);
+        ++active;
+      }
+      // A due job held back by the cap starts once a poll in flight
+      // finishes, which wakes curl_multi_poll; it must not pull the wakeup
+      // into the past, or drain() would spin on curl_multi_perform
+    } else {
+      wakeup = std::min(wakeup, job->nextPoll);
+    }
+  }
+  if (active > 0) {
+    curl_multi_perform(multi_, &running);
+    // A poll that has already finished leaves nothing on its socket to wake
+    // curl_multi_poll, so collect it straight away
+    if (static_cast<size_t>(running) < active) {
+      return;
+    }
+  }
+
+  // With every job finished there is nothing to wait for
+  int waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   wakeup - Clock::now())
+                   .count();
+  if (waitMs > 0 && !jobs_.empty()) {
+    curl_multi_poll(multi_, NULL, 0, waitMs, NULL);
+  }
+}
+
+void JobTracker::drain() {
+  while (!jobs_.empty()) {
+    poll(100);
+  }
+}
+
+void JobTracker::report() const {
+  LOG(LOG_INFO) << "Jobs completed: " << completed_ << ", polls: "
+                << totalPolls_ << " ("
+                << (completed_ ? static_cast<double>(totalPolls_) / completed_
+                               : 0)
+                << " per job), completion latency mean "
+                << (completed_ ? toMs(totalLatency_) / completed_ : 0)
+                << " ms, max " << toMs(maxLatency_) << " ms";
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "upload.h"
+
+// Follows outstanding asynchronous add-data jobs until they finish.  Each job
+// is polled at an interval that starts at --job-poll-initial-ms and doubles
+// after every unfinished poll up to --job-poll-max-ms.  Polls for different
+// jobs run concurrently over a curl_multi handle.
+//
+// Like AsyncSender, a JobTracker is driven by the thread that owns it and
+// runs callbacks on that thread.  A job that finishes with a failing response
+// ends the process, as the serial loop always has.
+class JobTracker {
+public:
+  typedef std::function<void()> Callback;
+  typedef std::chrono::steady_clock Clock;
+
+  JobTracker();
+  ~JobTracker();
+
+  size_t outstanding() const { return jobs_.size(); }
+
+  // Starts following the job at jobUri (the Location of an add-data
+  // response); done is called once it has finished successfully.
+  void track(const std::string &jobUri, Callback done);
+
+  // Sends any polls that are due and processes their responses, waiting up
+  // to timeoutMs for activity.
+  void poll(int timeoutMs);
+
+  // Blocks until every tracked job has finished.
+  void drain();
+
+  // Prints job completion latency and poll counts.
+  void report() const;
+
+private:
+  struct Job {
+    std::string url;
+    Clock::time_point started;
+    Clock::time_point nextPoll;
+    Clock::duration interval;
+    int polls = 0;
+    bool polling = false;
+    Callback done;
+  };
+
+  struct PollHandle {
+    UploadHandle handle;
+    Job *job = NULL;
+  };
+
+  void startPoll(Job *job);
+  // Returns true if the job has finished
+  bool finishPoll(PollHandle *poll, CURLcode code);
+  void complete(Job *job);
+
+  CURLM *multi_;
+  std::vector<std::unique_ptr<Job>> jobs_;
+  std::vector<std::unique_ptr<PollHandle>> handles_;
+  std::vector<PollHandle *> idle_;
+
+  long completed_;
+  long long totalPolls_;
+  Clock::duration totalLatency_;
+  Clock::duration maxLatency_;
+};
@@ -0,0 +1,292 @@
+#include "log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "rapidjson/internal/itoa.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+std::atomic<int> logThreshold(LOG_INFO);
+
+namespace {
+
+const char *LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+
+// Lines the ring holds before debug and info lines are dropped; a power of
+// two
+const size_t RING_SIZE = 4096;
+// How long the writer sleeps once it has caught up
+const int IDLE_SLEEP_MS = 5;
+
+// Ends a line cut at LogLine::MAX_LENGTH, so it is not taken for the whole
+// message
+const char TRUNCATION_MARKER[] = "...(truncated)";
+
+// A ring entry.  sequence says whose turn it is: the producer holding ticket
+// n may fill the slot when it reads n, and the writer may take it when it
+// reads n + 1.
+struct Slot {
+  std::atomic<uint64_t> sequence;
+  LogLevel level;
+  uint32_t length;
+  // Wall clock time of the call, in microseconds since the epoch
+  int64_t timeUs;
+  char text[LogLine::MAX_LENGTH];
+};
+
+// Log lines travel from any thread through a bounded lock-free ring (after
+// Vyukov's MPMC queue) to a single writer thread, which formats their
+// timestamps and writes them to stdout in batches.  Producers never take a
+// lock or make a system call; only the writer does, and flushLog() when it
+// writes on the writer's behalf.
+class Logger {
+public:
+  Logger() : head_(0), tail_(0), dropped_(0), json_(false) {
+    for (size_t i = 0; i < RING_SIZE; ++i) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    std::atexit(flushLog);
+    std::thread(&Logger::run, this).detach();
+  }
+
+  void setJson(bool json) { json_.store(json, std::memory_order_relaxed); }
+
+  // Queues a line.  Returns false if the ring is full.
+  bool push(LogLevel level, int64_t timeUs, const char *text,
+            size_t length) {
+    uint64_t ticket = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots_[ticket & (RING_SIZE - 1)];
+      int64_t turn =
+          static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) -
+                               ticket);
+      if (turn == 0) {
+        if (head_.compare_exchange_weak(ticket, ticket + 1,
+                                        std::memory_order_relaxed)) {
+          slot.level = level;
+          slot.timeUs = timeUs;
+          slot.length = static_cast<uint32_t>(length);
+          memcpy(slot.text, text, length);
+          slot.sequence.store(ticket + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (turn < 0) {
+        return false;
+      } else {
+        ticket = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void drop() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Writes out every line that has been published.  Returns false if there
+  // were none.
+  bool drain() {
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    output_.Clear();
+    bool json = json_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots_[tail_ & (RING_SIZE - 1)];
+      if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+        break;
+      }
+      format(slot.level, slot.timeUs, slot.text, slot.length, json);
+      slot.sequence.store(tail_ + RING_SIZE, std::memory_order_release);
+      ++tail_;
+    }
+    uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      char text[64];
+      int length = snprintf(text, sizeof(text),
+                            "Dropped %llu log lines; the log fell behind",
+                            static_cast<unsigned long long>(dropped));
+      format(LOG_WARN, nowUs(), text, length, json);
+    }
+    if (output_.GetSize() == 0) {
+      return false;
+    }
+    fwrite(output_.GetString(), 1, output_.GetSize(), stdout);
+    fflush(stdout);
+    return true;
+  }
+
+  static int64_t nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+private:
+  void run() {
+    while (true) {
+      if (!drain()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+      }
+    }
+  }
+
+  // Appends a line to output_ as "<time>: <text>" or as a JSON object
+  void format(LogLevel level, int64_t timeUs, const char *text,
+              size_t length, bool json) {
+    time_t seconds = static_cast<time_t>(timeUs / 1000000);
+    if (!json) {
+      char time[16];
+      formatTimeString(seconds, time);
+      output_.Reserve(length + 20);
+      for (const char *c = time; *c; ++c) {
+        output_.Put(*c);
+      }
+      output_.Put(':');
+      output_.Put(' ');
+      memcpy(output_.Push(length), text, length);
+      output_.Put('\n');
+      return;
+    }
+
+    if (seconds != jsonSecond_) {
+      struct tm utc;
+      gmtime_r(&seconds, &utc);
+      strftime(jsonTime_, sizeof(jsonTime_), "%Y-%m-%dT%H:%M:%S", &utc);
+      jsonSecond_ = seconds;
+    }
+    char time[32];
+    int timeLength = snprintf(time, sizeof(time), "%s.%03dZ", jsonTime_,
+                              static_cast<int>(timeUs / 1000 % 1000));
+    rapidjson::Writer<rapidjson::StringBuffer> writer(output_);
+    writer.StartObject();
+    writer.Key("time");
+    writer.String(time, timeLength);
+    writer.Key("level");
+    writer.String(LEVEL_NAMES[level]);
+    writer.Key("message");
+    writer.String(text, static_cast<rapidjson::SizeType>(length));
+    writer.EndObject();
+    output_.Put('\n');
+  }
+
+  Slot slots_[RING_SIZE];
+  std::atomic<uint64_t> head_;
+  // Keeps the producers' ticket off the writer's cache line
+  char padding_[64];
+  uint64_t tail_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<bool> json_;
+  std::mutex writeMutex_;
+  rapidjson::StringBuffer output_;
+  time_t jsonSecond_ = -1;
+  char jsonTime_[24];
+};
+
+Logger &logger() {
+  // Never destroyed, so threads still logging during exit find it intact
+  static Logger *instance = new Logger;
+  return *instance;
+}
+
+} // namespace
+
+bool parseLogLevel(const std::string &name, LogLevel &level) {
+  for (int i = LOG_DEBUG; i <= LOG_ERROR; ++i) {
+    if (name == LEVEL_NAMES[i]) {
+      level = static_cast<LogLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseLogFormat(const std::string &name, bool &json) {
+  if (name != "text" && name != "json") {
+    return false;
+  }
+  json = name == "json";
+  return true;
+}
+
+void configureLog(LogLevel level, bool json) {
+  logThreshold.store(level, std::memory_order_relaxed);
+  logger().setJson(json);
+}
+
+void flushLog() { logger().drain(); }
+
+void formatTimeString(time_t t, char *buffer) {
+  static thread_local time_t cachedSecond = -1;
+  static thread_local char cached[16];
+  if (t != cachedSecond) {
+    struct tm utc;
+    gmtime_r(&t, &utc);
+    strftime(cached, sizeof(cached), "%Y%m%dT%H%M%S", &utc);
+    cachedSecond = t;
+  }
+  memcpy(buffer, cached, sizeof(cached));
+}
+
+LogLine::~LogLine() {
+  if (!logEnabled(level_)) {
+    return;
+  }
+  if (truncated_) {
+    // The marker replaces the end of the line, backed off to the start of a
+    // UTF-8 character so none is left cut in half
+    size_t at = MAX_LENGTH - (sizeof(TRUNCATION_MARKER) - 1);
+    while (at > 0 && (static_cast<unsigned char>(text_[at]) & 0xC0) == 0x80) {
+      --at;
+    }
+    memcpy(text_ + at, TRUNCATION_MARKER, sizeof(TRUNCATION_MARKER) - 1);
+    length_ = at + sizeof(TRUNCATION_MARKER) - 1;
+  }
+  int64_t timeUs = Logger::nowUs();
+  // Warnings and errors wait for room rather than be lost
+  while (!logger().push(level_, timeUs, text_, length_)) {
+    if (level_ < LOG_WARN) {
+      logger().drop();
+      return;
+    }
+    std::this_thread::yield();
+  }
+}
+
+LogLine &LogLine::append(const char *text, size_t length) {
+  size_t room = MAX_LENGTH - length_;
+  if (length > room) {
+    length = room;
+    truncated_ = true;
+  }
+  memcpy(text_ + length_, text, length);
+  length_ += length;
+  return *this;
+}
+
+LogLine &LogLine::operator<<(const char *text) {
+  return append(text, strlen(text));
+}
+
+LogLine &LogLine::operator<<(const std::string &text) {
+  return append(text.data(), text.size());
+}
+
+LogLine &LogLine::operator<<(char c) { return append(&c, 1); }
+
+LogLine &LogLine::operator<<(double value) {
+  // %g matches std::ostream's default formatting
+  char text[32];
+  int length = snprintf(text, sizeof(text), "%g", value);
+  return append(text, length);
+}
+
+LogLine &LogLine::appendSigned(int64_t value) {
+  char text[24];
+  return append(text, rapidjson::internal::i64toa(value, text) - text);
+}
+
+LogLine &LogLine::appendUnsigned(uint64_t value) {
+  char text[24];
+  return append(text, rapidjson::internal::u64toa(value, text) - text);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <type_traits>
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// The least severe level written; set from --log-level
+extern std::atomic<int> logThreshold;
+
+inline bool logEnabled(LogLevel level) {
+  return level >= logThreshold.load(std::memory_order_relaxed);
+}
+
+// Parses --log-level and --log-format.  Returns false for unknown values.
+bool parseLogLevel(const std::string &name, LogLevel &level);
+bool parseLogFormat(const std::string &name, bool &json);
+
+// Applies --log-level and --log-format
+void configureLog(LogLevel level, bool json);
+
+// Writes out every line logged so far.  Runs at exit as well.
+void flushLog();
+
+// Writes t (UTC) as an ISO 8601 basic timestamp, e.g. 20240101T120000, to
+// buffer, which must hold 16 characters; formatting is redone only when the
+// second changes.
+void formatTimeString(time_t t, char *buffer);
+
+// One log line, formatted on the stack as it is built and handed to the
+// background writer when it goes out of scope, unless its level is below the
+// threshold.  Lines longer than MAX_LENGTH are cut short and end in
+// "...(truncated)".  LOG() skips building the line altogether below the
+// threshold.
+class LogLine {
+public:
+  static const size_t MAX_LENGTH = 480;
+
+  explicit LogLine(LogLevel level)
+      : level_(level), length_(0), truncated_(false) {}
+  ~LogLine();
+
+  LogLine &operator<<(const char *text);
+  LogLine &operator<<(const std::string &text);
+  LogLine &operator<<(char c);
+  LogLine &operator<<(double value);
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value,
+                          LogLine &>::type
+  operator<<(T value) {
+    if (std::is_signed<T>::value || std::is_enum<T>::value) {
+      return appendSigned(static_cast<int64_t>(value));
+    }
+    return appendUnsigned(static_cast<uint64_t>(value));
+  }
+
+private:
+  LogLine(const LogLine &);
+  LogLine &operator=(const LogLine &);
+
+  LogLine &append(const char *text, size_t length);
+  LogLine &appendSigned(int64_t value);
+  LogLine &appendUnsigned(uint64_t value);
+
+  LogLevel level_;
+  size_t length_;
+  bool truncated_;
+  char text_[MAX_LENGTH];
+};
+
+// LOG(LOG_INFO) << "Updating " << count << " entities";
+#define LOG(level)                                                             \
+  if (!logEnabled(level)) {                                                    \
+  } else                                                                       \
+    LogLine(level)
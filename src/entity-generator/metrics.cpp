@@ -0,0 +1,318 @@
+#include "metrics.h"
+
+#include <cmath>
+#include <sstream>
+
+#include "entity.h"
+#include "log.h"
+
+Metrics metrics;
+
+namespace {
+
+const char *PHASE_NAMES[PHASE_COUNT] = {"simulate", "serialize", "compress",
+                                        "post",     "job",       "write"};
+const char *COUNTER_NAMES[COUNTER_COUNT] = {
+    "ticks",   "entities",      "bytes",            "requests",
+    "retries", "5xx_responses", "transport_errors", "jobs",
+    "job_polls"};
+const char *COUNTER_HELP[COUNTER_COUNT] = {
+    "Ticks simulated",
+    "Entities in add-data bodies the server accepted",
+    "Bytes, as sent, of add-data bodies the server accepted",
+    "Add-data requests sent, including retries",
+    "Add-data requests retried",
+    "Add-data requests answered with a 5xx status",
+    "Add-data requests that got no response",
+    "Add-data jobs finished",
+    "Job status requests sent"};
+const char *GAUGE_NAMES[GAUGE_COUNT] = {"in_flight_requests", "pending_jobs",
+                                        "lag_seconds"};
+const char *GAUGE_HELP[GAUGE_COUNT] = {
+    "Add-data requests in flight",
+    "Add-data jobs not yet finished",
+    "How late the last governed tick started"};
+
+// Bucket bounds of the exported histograms, in seconds
+const double PROMETHEUS_BOUNDS[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                    0.005,  0.01,    0.025,  0.05,  0.1,
+                                    0.25,   0.5,     1,      2.5,   5,
+                                    10,     30,      60};
+const char *PROMETHEUS_PREFIX = "entity_generator_";
+
+const double PERCENTILES[] = {0.5, 0.99, 0.999};
+const char *PERCENTILE_LABELS[] = {"p50", "p99", "p999"};
+
+double toMs(double ns) { return ns / 1e6; }
+
+double seconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+// Index of the highest set bit of value, which must not be zero
+int highestBit(uint64_t value) { return 63 - __builtin_clzll(value); }
+
+} // namespace
+
+const char *phaseName(Phase phase) { return PHASE_NAMES[phase]; }
+
+const char *counterName(Counter counter) { return COUNTER_NAMES[counter]; }
+
+const char *gaugeName(Gauge gauge) { return GAUGE_NAMES[gauge]; }
+
+uint64_t HistogramSnapshot::percentile(double q) const {
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(std::ceil(q * total));
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return LatencyHistogram::bucketLimit(i);
+    }
+  }
+  return LatencyHistogram::bucketLimit(counts.size() - 1);
+}
+
+void HistogramSnapshot::subtract(const HistogramSnapshot &earlier) {
+  for (size_t i = 0; i < counts.size() && i < earlier.counts.size(); ++i) {
+    counts[i] -= earlier.counts[i];
+  }
+  total -= earlier.total;
+  sumNs -= earlier.sumNs;
+}
+
+LatencyHistogram::LatencyHistogram() : sumNs_(0) {
+  for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+    counts_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+size_t LatencyHistogram::bucketFor(uint64_t ns) {
+  if (ns < SUB_BUCKETS) {
+    return ns;
+  }
+  // Keep the top eight bits: the highest selects the power of two and the
+  // other seven the bucket within it
+  int shift = highestBit(ns) - 7;
+  return SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2) +
+         ((ns >> shift) - SUB_BUCKETS / 2);
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  size_t shift = (bucket - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+  uint64_t mantissa = (bucket - SUB_BUCKETS) % (SUB_BUCKETS / 2) +
+                      SUB_BUCKETS / 2;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  counts_[bucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+  sumNs_.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::snapshot(HistogramSnapshot &out) const {
+  out.counts.resize(BUCKET_COUNT);
+  // Recorders may run while this reads, so the total is summed from the
+  // buckets read to keep percentiles consistent
+  out.total = 0;
+  for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+    out.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    out.total += out.counts[i];
+  }
+  out.sumNs = sumNs_.load(std::memory_order_relaxed);
+}
+
+Metrics::Metrics() {
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    counters_[i].store(0, std::memory_order_relaxed);
+  }
+  for (int i = 0; i < GAUGE_COUNT; ++i) {
+    gauges_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void writePrometheusText(std::ostream &out) {
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    const std::string name =
+        std::string(PROMETHEUS_PREFIX) + COUNTER_NAMES[i] + "_total";
+    out << "# HELP " << name << " " << COUNTER_HELP[i] << "\n"
+        << "# TYPE " << name << " counter\n"
+        << name << " " << metrics.count(static_cast<Counter>(i)) << "\n";
+  }
+  for (int i = 0; i < GAUGE_COUNT; ++i) {
+    const std::string name = std::string(PROMETHEUS_PREFIX) + GAUGE_NAMES[i];
+    int64_t level = metrics.level(static_cast<Gauge>(i));
+    out << "# HELP " << name << " " << GAUGE_HELP[i] << "\n"
+        << "# TYPE " << name << " gauge\n" << name << " ";
+    if (i == GAUGE_LAG_NS) {
+      out << level / 1e9;
+    } else {
+      out << level;
+    }
+    out << "\n";
+  }
+
+  // The fine-grained buckets are folded into a fixed set of bounds; a bucket
+  // counts towards a bound once its largest value is within it
+  const std::string name =
+      std::string(PROMETHEUS_PREFIX) + "phase_duration_seconds";
+  out << "# HELP " << name << " Latency of each phase of a tick\n"
+      << "# TYPE " << name << " histogram\n";
+  HistogramSnapshot phase;
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    metrics.snapshot(static_cast<Phase>(i), phase);
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (size_t b = 0;
+         b < sizeof(PROMETHEUS_BOUNDS) / sizeof(PROMETHEUS_BOUNDS[0]); ++b) {
+      const double limitNs = PROMETHEUS_BOUNDS[b] * 1e9;
+      for (; bucket < phase.counts.size() &&
+             LatencyHistogram::bucketLimit(bucket) <= limitNs;
+           ++bucket) {
+        cumulative += phase.counts[bucket];
+      }
+      out << name << "_bucket{phase=\"" << PHASE_NAMES[i] << "\",le=\""
+          << PROMETHEUS_BOUNDS[b] << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{phase=\"" << PHASE_NAMES[i]
+        << "\",le=\"+Inf\"} " << phase.total << "\n"
+        << name << "_sum{phase=\"" << PHASE_NAMES[i] << "\"} "
+        << phase.sumNs / 1e9 << "\n"
+        << name << "_count{phase=\"" << PHASE_NAMES[i] << "\"} "
+        << phase.total << "\n";
+  }
+}
+
+MetricsEndpoint::MetricsEndpoint() : server_(handle) {}
+
+bool MetricsEndpoint::start(const std::string &address, int port) {
+  if (!server_.listenTcp(address, port)) {
+    return false;
+  }
+  server_.start();
+  LOG(LOG_INFO) << "Serving metrics on http://" << address << ":"
+                << server_.port() << "/metrics";
+  return true;
+}
+
+void MetricsEndpoint::handle(const HttpRequest &request,
+                             HttpResponse &response) {
+  if (request.target != "/metrics") {
+    response.status = 404;
+    return;
+  }
+  if (request.method != "GET") {
+    response.status = 405;
+    return;
+  }
+  std::ostringstream text;
+  writePrometheusText(text);
+  response.headers.push_back(
+      std::make_pair("Content-Type", "text/plain; version=0.0.4"));
+  response.body = text.str();
+}
+
+MetricsReporter::MetricsReporter() : running_(false) {}
+
+MetricsReporter::~MetricsReporter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    wake_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void MetricsReporter::start() {
+  take(start_);
+  if (options.metricsInterval > 0) {
+    running_ = true;
+    thread_ = std::thread(&MetricsReporter::run, this);
+  }
+}
+
+void MetricsReporter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    wake_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  Sample end;
+  take(end);
+  print("whole run", start_, end);
+}
+
+void MetricsReporter::run() {
+  const std::chrono::steady_clock::duration interval =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(options.metricsInterval));
+  Sample previous = start_;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    if (wake_.wait_until(lock, previous.time + interval,
+                         [this] { return !running_; })) {
+      break;
+    }
+    Sample current;
+    take(current);
+    std::ostringstream label;
+    label << "last " << options.metricsInterval << " s";
+    print(label.str().c_str(), previous, current);
+    previous = current;
+  }
+}
+
+void MetricsReporter::take(Sample &sample) {
+  sample.time = std::chrono::steady_clock::now();
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    sample.counters[i] = metrics.count(static_cast<Counter>(i));
+  }
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    metrics.snapshot(static_cast<Phase>(i), sample.phases[i]);
+  }
+}
+
+void MetricsReporter::print(const char *label, const Sample &from,
+                            const Sample &to) {
+  double elapsed = seconds(to.time - from.time);
+  {
+    LogLine line(LOG_INFO);
+    line << "Metrics (" << label << "):";
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+      uint64_t count = to.counters[i] - from.counters[i];
+      line << " " << COUNTER_NAMES[i] << " " << count;
+      if (i == COUNTER_ENTITIES || i == COUNTER_BYTES) {
+        line << " (" << (elapsed > 0 ? count / elapsed : 0) << "/s)";
+      }
+    }
+  }
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    HistogramSnapshot phase = to.phases[i];
+    phase.subtract(from.phases[i]);
+    if (phase.total == 0) {
+      continue;
+    }
+    LogLine line(LOG_INFO);
+    line << "  " << PHASE_NAMES[i] << " ms: n " << phase.total << " mean "
+         << toMs(phase.meanNs());
+    for (size_t p = 0; p < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]);
+         ++p) {
+      line << " " << PERCENTILE_LABELS[p] << " "
+           << toMs(phase.percentile(PERCENTILES[p]));
+    }
+    line << " max " << toMs(phase.max());
+  }
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http-server.h"
+
+// The stages of a tick whose latency is recorded
+enum Phase {
+  PHASE_SIMULATE,
+  PHASE_SERIALIZE,
+  PHASE_COMPRESS,
+  PHASE_POST,
+  PHASE_JOB,
+  // Appending bodies to --output files
+  PHASE_WRITE,
+  PHASE_COUNT
+};
+
+enum Counter {
+  COUNTER_TICKS,
+  // Entities and bytes (as sent) in add-data bodies the server accepted
+  COUNTER_ENTITIES,
+  COUNTER_BYTES,
+  // Add-data attempts, including retries
+  COUNTER_REQUESTS,
+  COUNTER_RETRIES,
+  COUNTER_SERVER_ERRORS,
+  // Attempts libcurl could not complete
+  COUNTER_TRANSPORT_ERRORS,
+  COUNTER_JOBS,
+  COUNTER_JOB_POLLS,
+  COUNTER_COUNT
+};
+
+// Levels that go up and down rather than accumulate
+enum Gauge {
+  GAUGE_IN_FLIGHT,
+  GAUGE_PENDING_JOBS,
+  // How late the last governed tick started, in nanoseconds
+  GAUGE_LAG_NS,
+  GAUGE_COUNT
+};
+
+const char *phaseName(Phase phase);
+const char *counterName(Counter counter);
+const char *gaugeName(Gauge gauge);
+
+// The counts of a LatencyHistogram at one moment, or the difference between
+// two such moments.
+struct HistogramSnapshot {
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t sumNs = 0;
+
+  // The latency (ns) that fraction q of the samples do not exceed, to the
+  // histogram's precision; 0 without samples
+  uint64_t percentile(double q) const;
+  uint64_t max() const { return percentile(1); }
+  double meanNs() const {
+    return total ? static_cast<double>(sumNs) / total : 0;
+  }
+
+  // Replaces this snapshot's counts with those recorded since earlier
+  void subtract(const HistogramSnapshot &earlier);
+};
+
+// A high dynamic range histogram of latencies in nanoseconds.  Values below
+// 256 ns are counted exactly; above that, each power of two is split into
+// 128 buckets, so every value is known to within 0.8%.  record() is lock free
+// and may be called from any thread.
+class LatencyHistogram {
+public:
+  static const size_t SUB_BUCKETS = 256;
+  static const size_t BUCKET_COUNT = SUB_BUCKETS + 56 * (SUB_BUCKETS / 2);
+
+  LatencyHistogram();
+
+  void record(uint64_t ns);
+  void snapshot(HistogramSnapshot &out) const;
+
+  static size_t bucketFor(uint64_t ns);
+  // The largest value that lands in bucket
+  static uint64_t bucketLimit(size_t bucket);
+
+private:
+  LatencyHistogram(const LatencyHistogram &);
+  LatencyHistogram &operator=(const LatencyHistogram &);
+
+  std::atomic<uint64_t> counts_[BUCKET_COUNT];
+  std::atomic<uint64_t> sumNs_;
+};
+
+// Every phase's latencies and every counter, for the whole run.  Updates are
+// relaxed atomic adds, so the stages record without coordinating.
+class Metrics {
+public:
+  Metrics();
+
+  void record(Phase phase, std::chrono::steady_clock::duration latency) {
+    int64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    histograms_[phase].record(ns > 0 ? ns : 0);
+  }
+  void add(Counter counter, uint64_t count = 1) {
+    counters_[counter].fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void adjust(Gauge gauge, int64_t delta) {
+    gauges_[gauge].fetch_add(delta, std::memory_order_relaxed);
+  }
+  void set(Gauge gauge, int64_t value) {
+    gauges_[gauge].store(value, std::memory_order_relaxed);
+  }
+
+  uint64_t count(Counter counter) const {
+    return counters_[counter].load(std::memory_order_relaxed);
+  }
+  int64_t level(Gauge gauge) const {
+    return gauges_[gauge].load(std::memory_order_relaxed);
+  }
+  void snapshot(Phase phase, HistogramSnapshot &out) const {
+    histograms_[phase].snapshot(out);
+  }
+
+private:
+  LatencyHistogram histograms_[PHASE_COUNT];
+  std::atomic<uint64_t> counters_[COUNTER_COUNT];
+  std::atomic<int64_t> gauges_[GAUGE_COUNT];
+};
+
+extern Metrics metrics;
+
+// Writes every counter, gauge and phase histogram in the Prometheus text
+// exposition format.  Only reads the atomics, so scrapes never block the
+// stages that record.
+void writePrometheusText(std::ostream &out);
+
+// Serves writePrometheusText() at /metrics for --metrics-port, from the
+// HttpServer's own threads.
+class MetricsEndpoint {
+public:
+  MetricsEndpoint();
+
+  // Listens on address:port and starts serving.  Returns false, after
+  // logging, if the port cannot be bound.
+  bool start(const std::string &address, int port);
+
+private:
+  static void handle(const HttpRequest &request, HttpResponse &response);
+
+  HttpServer server_;
+};
+
+// Records the time from construction to destruction against a phase
+class PhaseTimer {
+public:
+  explicit PhaseTimer(Phase phase)
+      : phase_(phase), start_(std::chrono::steady_clock::now()) {}
+  ~PhaseTimer() {
+    metrics.record(phase_, std::chrono::steady_clock::now() - start_);
+  }
+
+private:
+  Phase phase_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Prints the counters and each phase's p50, p99 and p999 for the last
+// --metrics-interval seconds, from a background thread, and for the whole run
+// once stopped.
+class MetricsReporter {
+public:
+  MetricsReporter();
+  ~MetricsReporter();
+
+  void start();
+  // Stops the periodic summaries and prints the one for the whole run
+  void stop();
+
+private:
+  struct Sample {
+    std::chrono::steady_clock::time_point time;
+    uint64_t counters[COUNTER_COUNT];
+    HistogramSnapshot phases[PHASE_COUNT];
+  };
+
+  void run();
+  static void take(Sample &sample);
+  static void print(const char *label, const Sample &from, const Sample &to);
+
+  Sample start_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool running_;
+};
@@ -0,0 +1,381 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+#include <boost/program_options.hpp>
+
+#include "rapidjson/reader.h"
+
+#include "compress.h"
+#include "entity.h"
+#include "http-server.h"
+
+namespace po = boost::program_options;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const std::string ADD_DATA_PREFIX = "/conduce/api/v1/datasets/add-data/";
+const std::string JOB_PREFIX = "/conduce/api/v1/jobs/";
+
+struct MockOptions {
+  std::string address;
+  int port = 0;
+  std::string unixSocket;
+  std::string tlsCert;
+  std::string tlsKey;
+  std::string apiKey;
+  int latencyMs = 0;
+  int latencyJitterMs = 0;
+  double failureRate = 0;
+  int jobDelayMs = 0;
+  double jobFailureRate = 0;
+  double maxBytesPerSecond = 0;
+  int reportIntervalS = 10;
+  bool absoluteLocation = false;
+};
+
+MockOptions mock;
+
+struct Counters {
+  std::atomic<unsigned long long> requests;
+  std::atomic<unsigned long long> accepted;
+  std::atomic<unsigned long long> injectedFailures;
+  std::atomic<unsigned long long> rejected;
+  std::atomic<unsigned long long> entities;
+  std::atomic<unsigned long long> wireBytes;
+  std::atomic<unsigned long long> jsonBytes;
+  std::atomic<unsigned long long> jobPolls;
+  std::atomic<unsigned long long> jobsFailed;
+};
+
+Counters counters;
+
+struct Job {
+  Clock::time_point ready;
+  bool fail;
+};
+
+std::mutex jobsMutex;
+std::map<unsigned long long, Job> jobs;
+unsigned long long nextJob = 1;
+
+// The next time the throughput cap lets a body through
+std::mutex throttleMutex;
+Clock::time_point throttleFree;
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+// Each connection thread gets its own generator for injected faults
+double uniform() {
+  static thread_local std::mt19937_64 generator(std::random_device{}());
+  return std::uniform_real_distribution<double>(0, 1)(generator);
+}
+
+// Counts the objects in the request's top level "entities" array
+struct EntityCounter
+    : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, EntityCounter> {
+  int depth = 0;
+  unsigned long long count = 0;
+
+  bool Default() { return true; }
+  bool StartObject() {
+    if (++depth == 2) {
+      ++count;
+    }
+    return true;
+  }
+  bool EndObject(rapidjson::SizeType) {
+    --depth;
+    return true;
+  }
+};
+
+// Holds a body back until the throughput cap allows it through
+void throttle(size_t bytes) {
+  if (mock.maxBytesPerSecond <= 0) {
+    return;
+  }
+  Clock::duration cost = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(bytes / mock.maxBytesPerSecond));
+  Clock::time_point release;
+  {
+    std::lock_guard<std::mutex> lock(throttleMutex);
+    Clock::time_point now = Clock::now();
+    if (throttleFree < now) {
+      throttleFree = now;
+    }
+    throttleFree += cost;
+    release = throttleFree;
+  }
+  std::this_thread::sleep_until(release);
+}
+
+void addLatency() {
+  int delayMs = mock.latencyMs;
+  if (mock.latencyJitterMs > 0) {
+    delayMs += static_cast<int>(uniform() * mock.latencyJitterMs);
+  }
+  if (delayMs > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+  }
+}
+
+void handleAddData(const HttpRequest &request, HttpResponse &response) {
+  counters.wireBytes += request.body.size();
+  throttle(request.body.size());
+  addLatency();
+
+  if (uniform() < mock.failureRate) {
+    ++counters.injectedFailures;
+    response.status = 503;
+    return;
+  }
+
+  const std::string &encoding = request.header("content-encoding");
+  std::string decoded;
+  const std::string *json = &request.body;
+  if (!encoding.empty() && encoding != "identity") {
+    if (!decompressPayload(encoding, request.body, decoded)) {
+      ++counters.rejected;
+      response.status = 400;
+      response.body = "Unable to decode " + encoding + " body";
+      return;
+    }
+    json = &decoded;
+  }
+
+  EntityCounter counter;
+  rapidjson::Reader reader;
+  rapidjson::StringStream stream(json->c_str());
+  if (reader.Parse(stream, counter).IsError()) {
+    ++counters.rejected;
+    response.status = 400;
+    response.body = "Malformed JSON";
+    return;
+  }
+  counters.jsonBytes += json->size();
+  counters.entities += counter.count;
+  ++counters.accepted;
+
+  unsigned long long id;
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    id = nextJob++;
+    Job &job = jobs[id];
+    job.ready = Clock::now() + std::chrono::milliseconds(mock.jobDelayMs);
+    job.fail = uniform() < mock.jobFailureRate;
+  }
+  response.status = 202;
+  std::string location = JOB_PREFIX + std::to_string(id);
+  if (mock.absoluteLocation) {
+    location = (mock.tlsCert.empty() ? "http://" : "https://") +
+               request.header("host") + location;
+  }
+  response.headers.push_back(std::make_pair("Location", location));
+}
+
+// Reports progress until the job is ready, then its outcome, after which the
+// job is forgotten
+void handleJob(const HttpRequest &request, HttpResponse &response) {
+  ++counters.jobPolls;
+  addLatency();
+  unsigned long long id =
+      strtoull(request.target.c_str() + JOB_PREFIX.size(), NULL, 10);
+
+  std::lock_guard<std::mutex> lock(jobsMutex);
+  std::map<unsigned long long, Job>::iterator job = jobs.find(id);
+  if (job == jobs.end()) {
+    response.status = 404;
+    return;
+  }
+  response.headers.push_back(
+      std::make_pair("Content-Type", "application/json"));
+  if (Clock::now() < job->second.ready) {
+    response.body = "{\"progress\":0.5}";
+    return;
+  }
+  if (job->second.fail) {
+    ++counters.jobsFailed;
+    response.body = "{\"progress\":1.0,\"response\":500,"
+                    "\"result\":\"injected failure\"}";
+  } else {
+    response.body = "{\"progress\":1.0,\"response\":200,\"result\":\"\"}";
+  }
+  jobs.erase(job);
+}
+
+void handle(const HttpRequest &request, HttpResponse &response) {
+  ++counters.requests;
+  if (!mock.apiKey.empty() &&
+      request.header("authorization") != "Bearer " + mock.apiKey) {
+    response.status = 401;
+    return;
+  }
+  if (request.target.compare(0, ADD_DATA_PREFIX.size(), ADD_DATA_PREFIX) ==
+      0) {
+    if (request.method != "POST") {
+      response.status = 405;
+      return;
+    }
+    handleAddData(request, response);
+  } else if (request.target.compare(0, JOB_PREFIX.size(), JOB_PREFIX) == 0) {
+    if (request.method != "GET") {
+      response.status = 405;
+      return;
+    }
+    handleJob(request, response);
+  } else {
+    response.status = 404;
+  }
+}
+
+void report(double elapsedS) {
+  std::cout << getTimeString() << ": requests " << counters.requests
+            << ", add-data accepted " << counters.accepted << ", injected "
+            << "failures " << counters.injectedFailures << ", rejected "
+            << counters.rejected << ", entities " << counters.entities
+            << " (" << counters.entities / elapsedS << "/s), wire bytes "
+            << counters.wireBytes << " (" << counters.wireBytes / elapsedS
+            << "/s), JSON bytes " << counters.jsonBytes << ", job polls "
+            << counters.jobPolls << ", failed jobs " << counters.jobsFailed
+            << std::endl;
+}
+
+void parseCommandLine(int argc, char *argv[]) {
+  po::options_description desc(
+      "entity-generator-mock-server stands in for a Conduce host's add-data "
+      "and job status endpoints, for load testing entity-generator offline."
+      "\n\nConfiguration options");
+  desc.add_options()("help", "Print the list of command line options")(
+      "address",
+      po::value<std::string>(&mock.address)->default_value("127.0.0.1"),
+      "Address to listen on")(
+      "port", po::value<int>(&mock.port)->default_value(8080),
+      "TCP port to listen on")(
+      "unix-socket", po::value<std::string>(&mock.unixSocket),
+      "Listen on this Unix-domain socket instead of TCP")(
+      "tls-cert", po::value<std::string>(&mock.tlsCert),
+      "PEM certificate chain; serves HTTPS with --tls-key")(
+      "tls-key", po::value<std::string>(&mock.tlsKey), "PEM private key")(
+      "api-key", po::value<std::string>(&mock.apiKey),
+      "Require this bearer token; any is accepted if unset")(
+      "latency-ms", po::value<int>(&mock.latencyMs)->default_value(0),
+      "Delay added before every response (ms)")(
+      "latency-jitter-ms",
+      po::value<int>(&mock.latencyJitterMs)->default_value(0),
+      "Further delay, uniform in [0, this), added to every response (ms)")(
+      "failure-rate", po::value<double>(&mock.failureRate)->default_value(0),
+      "Fraction of add-data requests answered with 503")(
+      "job-delay-ms", po::value<int>(&mock.jobDelayMs)->default_value(0),
+      "Time an add-data job takes to finish (ms)")(
+      "job-failure-rate",
+      po::value<double>(&mock.jobFailureRate)->default_value(0),
+      "Fraction of add-data jobs that finish with a 500 response")(
+      "max-bytes-per-second",
+      po::value<double>(&mock.maxBytesPerSecond)->default_value(0),
+      "Cap on add-data body bytes accepted per second, across all "
+      "connections; 0 for no cap")(
+      "report-interval",
+      po::value<int>(&mock.reportIntervalS)->default_value(10),
+      "Seconds between counter reports")(
+      "absolute-location",
+      po::bool_switch(&mock.absoluteLocation)->default_value(false),
+      "Give jobs' locations as absolute URLs, built from the request's Host "
+      "header, rather than paths");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    exit(0);
+  }
+
+  bool abort = false;
+  if (mock.failureRate < 0 || mock.failureRate > 1 ||
+      mock.jobFailureRate < 0 || mock.jobFailureRate > 1) {
+    std::cerr << "Failure rates must be between 0 and 1" << std::endl;
+    abort = true;
+  }
+  if (mock.latencyMs < 0 || mock.latencyJitterMs < 0 || mock.jobDelayMs < 0) {
+    std::cerr << "Delays must not be negative" << std::endl;
+    abort = true;
+  }
+  if (mock.reportIntervalS < 1) {
+    std::cerr << "--report-interval must be at least 1" << std::endl;
+    abort = true;
+  }
+  if (mock.tlsCert.empty() != mock.tlsKey.empty()) {
+    std::cerr << "HTTPS needs both a certificate and a key." << std::endl;
+    std::cerr << "entity-generator-mock-server --tls-cert=FILE --tls-key=FILE"
+              << std::endl;
+    abort = true;
+  }
+#ifndef HAVE_OPENSSL
+  if (!mock.tlsCert.empty()) {
+    std::cerr << "This build has no TLS support" << std::endl;
+    abort = true;
+  }
+#endif
+
+  if (abort) {
+    exit(1);
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  parseCommandLine(argc, argv);
+
+  HttpServer server(handle);
+  bool listening = mock.unixSocket.empty()
+                       ? server.listenTcp(mock.address, mock.port)
+                       : server.listenUnix(mock.unixSocket);
+  if (!listening) {
+    return 1;
+  }
+#ifdef HAVE_OPENSSL
+  if (!mock.tlsCert.empty() && !server.enableTls(mock.tlsCert, mock.tlsKey)) {
+    return 1;
+  }
+#endif
+
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+  server.start();
+  if (mock.unixSocket.empty()) {
+    std::cout << getTimeString() << ": Listening on " << mock.address << ":"
+              << server.port() << std::endl;
+  } else {
+    std::cout << getTimeString() << ": Listening on " << mock.unixSocket
+              << std::endl;
+  }
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point nextReport =
+      start + std::chrono::seconds(mock.reportIntervalS);
+  while (!stopRequested) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (Clock::now() >= nextReport) {
+      report(std::chrono::duration<double>(Clock::now() - start).count());
+      nextReport += std::chrono::seconds(mock.reportIntervalS);
+    }
+  }
+
+  server.stop();
+  report(std::chrono::duration<double>(Clock::now() - start).count());
+  return 0;
+}
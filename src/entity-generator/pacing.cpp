@@ -0,0 +1,226 @@
+#include "pacing.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <time.h>
+
+#include "entity.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace {
+
+// Upper bounds of every lateness bucket but the last, in microseconds
+const int64_t LATENESS_LIMITS_US[] = {100,    1000,    10000,
+                                      100000, 1000000, 10000000};
+const char *LATENESS_LABELS[] = {"<100us", "<1ms", "<10ms", "<100ms",
+                                 "<1s",    "<10s", ">=10s"};
+
+// Most of the target rate a token bucket can save up while idle
+const double BURST_SECONDS = 0.1;
+
+double toMs(TickScheduler::Clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// Sleeps until deadline on CLOCK_MONOTONIC, which steady_clock reads
+void sleepUntil(TickScheduler::Clock::time_point deadline) {
+  std::chrono::nanoseconds sinceEpoch =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          deadline.time_since_epoch());
+  timespec wake;
+  wake.tv_sec = sinceEpoch.count() / 1000000000;
+  wake.tv_nsec = sinceEpoch.count() % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) ==
+         EINTR) {
+  }
+}
+
+} // namespace
+
+uint64_t timeIntervalMs() {
+  return static_cast<uint64_t>(llround(options.timeInterval * 1000));
+}
+
+TickScheduler::TickScheduler()
+    : start_(Clock::now()),
+      interval_(std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(options.timeInterval))),
+      scheduled_(0), ticks_(0), skipped_(0), maxLateness_(0) {
+  for (int i = 0; i < LATENESS_BUCKETS; ++i) {
+    lateness_[i] = 0;
+  }
+}
+
+void TickScheduler::waitForNextTick() {
+  if (options.ungoverned || RateLimiter::enabled()) {
+    return;
+  }
+  ++scheduled_;
+  Clock::time_point deadline = start_ + scheduled_ * interval_;
+  Clock::time_point now = Clock::now();
+  if (deadline > now) {
+    LOG(LOG_DEBUG) << "Sleeping for " << toMs(deadline - now)
+                   << " milliseconds";
+    sleepUntil(deadline);
+    now = Clock::now();
+  } else {
+    LOG(LOG_INFO) << "Behind real-time by " << toMs(now - deadline)
+                  << " milliseconds";
+  }
+
+  Clock::duration late = now - deadline;
+  metrics.set(GAUGE_LAG_NS,
+              std::chrono::duration_cast<std::chrono::nanoseconds>(late)
+                  .count());
+  int bucket = 0;
+  while (bucket < LATENESS_BUCKETS - 1 &&
+         std::chrono::duration_cast<std::chrono::microseconds>(late).count() >=
+             LATENESS_LIMITS_US[bucket]) {
+    ++bucket;
+  }
+  ++lateness_[bucket];
+  ++ticks_;
+  if (late > maxLateness_) {
+    maxLateness_ = late;
+  }
+
+  // Skipping abandons every deadline that has already passed, so the next
+  // tick waits for the first one still ahead
+  if (options.behind == "skip" && late >= interval_) {
+    int64_t missed = late / interval_;
+    skipped_ += missed;
+    scheduled_ += missed;
+  }
+}
+
+void TickScheduler::report() const {
+  if (ticks_ == 0) {
+    return;
+  }
+  LogLine line(LOG_INFO);
+  line << "Tick lateness over " << ticks_ << " ticks:";
+  for (int i = 0; i < LATENESS_BUCKETS; ++i) {
+    line << " " << LATENESS_LABELS[i] << " " << lateness_[i];
+  }
+  line << "; max " << toMs(maxLateness_) << " ms, skipped " << skipped_
+       << " deadlines";
+}
+
+RateLimiter::RateLimiter()
+    : start_(Clock::now()), last_(start_),
+      level_(rampLevel(Clock::duration(0))),
+      waiting_(false), heldBack_(0), sentEntities_(0), sentBytes_(0) {
+  Bucket empty = {0, 0, 0};
+  entities_ = bytes_ = empty;
+  entities_.target = options.targetEntitiesPerSec;
+  bytes_.target = options.targetBytesPerSec;
+  // Start with a full burst, as if the limiter had been idle
+  refill(entities_, level_, BURST_SECONDS);
+  refill(bytes_, level_, BURST_SECONDS);
+}
+
+bool RateLimiter::enabled() {
+  return options.targetEntitiesPerSec > 0 || options.targetBytesPerSec > 0;
+}
+
+double RateLimiter::rampLevel(Clock::duration elapsed) const {
+  if (options.ramp == "none") {
+    return 1;
+  }
+  double progress = std::min(
+      1., std::chrono::duration<double>(elapsed).count() / options.rampSeconds);
+  if (options.ramp == "step") {
+    // Each step is held for an equal share of the ramp; the last one is the
+    // target itself
+    if (options.rampSteps < 2) {
+      return 1;
+    }
+    int step = std::min(options.rampSteps - 1,
+                        static_cast<int>(progress * options.rampSteps));
+    progress = static_cast<double>(step) / (options.rampSteps - 1);
+  }
+  return options.rampStart + (1 - options.rampStart) * progress;
+}
+
+void RateLimiter::refill(Bucket &bucket, double level, double seconds) {
+  if (bucket.target <= 0) {
+    return;
+  }
+  bucket.rate = bucket.target * level;
+  bucket.tokens = std::min(bucket.rate * BURST_SECONDS,
+                           bucket.tokens + bucket.rate * seconds);
+}
+
+void RateLimiter::refill(Clock::time_point now) {
+  double seconds = std::chrono::duration<double>(now - last_).count();
+  last_ = now;
+  double level = rampLevel(now - start_);
+  if (options.ramp == "step" && level != level_) {
+    LogLine line(LOG_INFO);
+    line << "Target rate raised to " << 100 * level << "%:";
+    if (entities_.target > 0) {
+      line << " " << entities_.target * level << " entities/s";
+    }
+    if (bytes_.target > 0) {
+      line << " " << bytes_.target * level << " bytes/s";
+    }
+  }
+  level_ = level;
+  refill(entities_, level, seconds);
+  refill(bytes_, level, seconds);
+}
+
+RateLimiter::Clock::duration RateLimiter::reserve(uint64_t entityCount,
+                                                  uint64_t bytes) {
+  Clock::time_point now = Clock::now();
+  refill(now);
+
+  // Wait for whichever bucket is deeper in debt to climb back to zero
+  double waitSeconds = 0;
+  if (entities_.target > 0 && entities_.tokens < 0) {
+    waitSeconds = -entities_.tokens / entities_.rate;
+  }
+  if (bytes_.target > 0 && bytes_.tokens < 0) {
+    waitSeconds = std::max(waitSeconds, -bytes_.tokens / bytes_.rate);
+  }
+  if (waitSeconds > 0) {
+    if (!waiting_) {
+      waiting_ = true;
+      waitingSince_ = now;
+    }
+    // Round up so a caller that sleeps this long finds the tokens there
+    return std::chrono::duration_cast<Clock::duration>(
+               std::chrono::duration<double>(waitSeconds)) +
+           Clock::duration(1);
+  }
+
+  if (waiting_) {
+    heldBack_ += now - waitingSince_;
+    waiting_ = false;
+  }
+  entities_.tokens -= entityCount;
+  bytes_.tokens -= bytes;
+  sentEntities_ += entityCount;
+  sentBytes_ += bytes;
+  return Clock::duration(0);
+}
+
+void RateLimiter::acquire(uint64_t entityCount, uint64_t bytes) {
+  Clock::duration wait;
+  while ((wait = reserve(entityCount, bytes)) > Clock::duration(0)) {
+    sleepUntil(Clock::now() + wait);
+  }
+}
+
+void RateLimiter::report() const {
+  double seconds = std::chrono::duration<double>(last_ - start_).count();
+  if (seconds <= 0) {
+    return;
+  }
+  LOG(LOG_INFO) << "Sent " << sentEntities_ << " entities ("
+                << sentEntities_ / seconds << "/s) and " << sentBytes_
+                << " bytes (" << sentBytes_ / seconds << "/s) in " << seconds
+                << " s; bodies held back " << toMs(heldBack_) << " ms";
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// --time-interval in whole milliseconds, the step entity timestamps advance by
+uint64_t timeIntervalMs();
+
+// Paces governed runs against the monotonic clock.  Tick n is due at the
+// start time plus n time intervals; each wait sleeps until an absolute
+// deadline, so time spent producing a tick never accumulates as drift.
+//
+// With a throughput target ticks are not scheduled at all: they are produced
+// as fast as the RateLimiter lets their bodies go.
+//
+// When a tick is produced after its deadline, --behind=catch-up sends the
+// late ticks back to back until the run is on schedule again, and
+// --behind=skip abandons the deadlines that have passed and waits for the
+// next one still ahead.
+class TickScheduler {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  TickScheduler();
+
+  // Sleeps until the next tick is due.  Does nothing when ungoverned or when
+  // a throughput target is set.
+  void waitForNextTick();
+
+  // Prints how late ticks started, as a histogram.
+  void report() const;
+
+private:
+  static const int LATENESS_BUCKETS = 7;
+
+  Clock::time_point start_;
+  Clock::duration interval_;
+  // Deadlines scheduled so far; the next tick is due at start_ + this many
+  // intervals
+  int64_t scheduled_;
+  int64_t ticks_;
+  int64_t skipped_;
+  // Ticks by lateness: under 100 us, 1 ms, 10 ms, 100 ms, 1 s, 10 s, and more
+  int64_t lateness_[LATENESS_BUCKETS];
+  Clock::duration maxLateness_;
+};
+
+// Holds add-data bodies back to --target-entities-per-sec and
+// --target-bytes-per-sec with a token bucket per target.  Each bucket fills
+// at the current target rate and holds at most a tenth of a second of it.  A
+// body may go once every bucket is non-negative and then takes its full
+// cost, possibly leaving a bucket in debt, so bodies larger than the burst
+// still pass at the target rate on average.
+//
+// --ramp raises the rate from --ramp-start of the targets to the targets over
+// --ramp-seconds, either linearly or in --ramp-steps equal steps, and then
+// holds it there.
+class RateLimiter {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  RateLimiter();
+
+  // Whether either throughput target is set
+  static bool enabled();
+
+  // Takes the tokens for a body of entityCount entities and bytes bytes and
+  // returns zero if it may be sent now; otherwise takes nothing and returns
+  // how long until it may.
+  Clock::duration reserve(uint64_t entityCount, uint64_t bytes);
+
+  // Sleeps until a body may be sent, then takes its tokens.
+  void acquire(uint64_t entityCount, uint64_t bytes);
+
+  // Prints the throughput achieved and how long bodies were held back.
+  void report() const;
+
+private:
+  struct Bucket {
+    double target;
+    double rate;
+    double tokens;
+  };
+
+  // Fraction of the targets in force after elapsed
+  double rampLevel(Clock::duration elapsed) const;
+  void refill(Clock::time_point now);
+  static void refill(Bucket &bucket, double level, double seconds);
+
+  Clock::time_point start_;
+  Clock::time_point last_;
+  Bucket entities_;
+  Bucket bytes_;
+  double level_;
+  // When the body now waiting was first refused, if one is
+  bool waiting_;
+  Clock::time_point waitingSince_;
+  Clock::duration heldBack_;
+  uint64_t sentEntities_;
+  uint64_t sentBytes_;
+};
@@ -0,0 +1,222 @@
+#include "pipeline.h"
+
+#include <cstdlib>
+#include <thread>
+
+#include "async-sender.h"
+#include "file-sink.h"
+#include "job-tracker.h"
+#include "log.h"
+#include "metrics.h"
+#include "pacing.h"
+#include "upload.h"
+
+namespace {
+
+void serializeStage(BoundedQueue<Tick *> &input, BoundedQueue<Tick *> &output,
+                    BoundedQueue<Tick *> &freeTicks) {
+  Tick *tick;
+  while (input.pop(tick)) {
+    serializePayload(tick->entities, tick->payload);
+    if (tick->payload.size() == 0) {
+      LOG(LOG_WARN) << "Zero length string";
+      freeTicks.push(tick);
+      continue;
+    }
+    output.push(tick);
+  }
+  output.close();
+}
+
+void sendStage(BoundedQueue<Tick *> &input, BoundedQueue<Tick *> &output,
+               BoundedQueue<Tick *> &freeTicks) {
+  AsyncSender sender(options.maxInFlight);
+  RateLimiter limiter;
+  // The tick whose bodies are being posted, and the next body to post
+  Tick *tick = NULL;
+  size_t next = 0;
+  while (true) {
+    if (!tick) {
+      // With nothing in flight there is nothing to drive, so block for
+      // input; otherwise keep the transfers moving while picking up new
+      // ticks.
+      if (sender.inFlight() == 0) {
+        if (!input.pop(tick)) {
+          break;
+        }
+      } else if (sender.full() || !input.tryPop(tick)) {
+        sender.poll(10);
+        continue;
+      }
+      // Each body is sent and retried on its own.  The tick moves on once
+      // all of them have finished, with the jobs of those that were
+      // accepted.
+      tick->jobUris.clear();
+      tick->pending = tick->payload.chunkCount();
+      next = 0;
+    }
+
+    if (sender.full()) {
+      sender.poll(10);
+      continue;
+    }
+    if (RateLimiter::enabled()) {
+      RateLimiter::Clock::duration wait = limiter.reserve(
+          tick->payload.chunkEntities[next], tick->payload.chunkSize(next));
+      if (wait > RateLimiter::Clock::duration(0)) {
+        // Keep the transfers moving while the body waits its turn
+        std::chrono::milliseconds waitMs =
+            std::chrono::duration_cast<std::chrono::milliseconds>(wait);
+        if (sender.inFlight() > 0) {
+          sender.poll(static_cast<int>(waitMs.count()) + 1);
+        } else {
+          std::this_thread::sleep_for(wait);
+        }
+        continue;
+      }
+    }
+
+    Tick *posted = tick;
+    sender.post(posted->payload.data() + posted->payload.chunkBegin(next),
+                posted->payload.chunkSize(next),
+                [posted, next, &output,
+                 &freeTicks](const UploadResult &result) {
+                  if (!result.jobUri.empty()) {
+                    posted->jobUris.push_back(result.jobUri);
+                    metrics.add(COUNTER_ENTITIES,
+                                posted->payload.chunkEntities[next]);
+                    metrics.add(COUNTER_BYTES, posted->payload.chunkSize(next));
+                  }
+                  if (--posted->pending > 0) {
+                    return;
+                  }
+                  if (posted->jobUris.empty()) {
+                    freeTicks.push(posted);
+                  } else {
+                    output.push(posted);
+                  }
+                });
+    if (++next == posted->payload.chunkCount()) {
+      tick = NULL;
+    }
+  }
+  sender.drain();
+  output.close();
+  if (RateLimiter::enabled()) {
+    limiter.report();
+  }
+}
+
+// Stands in for the send and track stages under --output: appends each body
+// to the sink and hands the tick straight back.
+void writeStage(BoundedQueue<Tick *> &input, BoundedQueue<Tick *> &freeTicks,
+                FileSink &sink) {
+  RateLimiter limiter;
+  Tick *tick;
+  while (input.pop(tick)) {
+    const PayloadBuffer &payload = tick->payload;
+    for (size_t c = 0; c < payload.chunkCount(); ++c) {
+      if (RateLimiter::enabled()) {
+        limiter.acquire(payload.chunkEntities[c], payload.chunkSize(c));
+      }
+      if (!sink.write(tick->payload.data() + payload.chunkBegin(c),
+                      payload.chunkSize(c))) {
+        exit(1);
+      }
+      metrics.add(COUNTER_ENTITIES, payload.chunkEntities[c]);
+      metrics.add(COUNTER_BYTES, payload.chunkSize(c));
+    }
+    freeTicks.push(tick);
+  }
+  if (RateLimiter::enabled()) {
+    limiter.report();
+  }
+}
+
+void trackStage(BoundedQueue<Tick *> &input, BoundedQueue<Tick *> &freeTicks) {
+  JobTracker tracker;
+  Tick *tick;
+  while (true) {
+    if (tracker.outstanding() == 0) {
+      if (!input.pop(tick)) {
+        break;
+      }
+    } else if (!input.tryPop(tick)) {
+      tracker.poll(10);
+      continue;
+    }
+    tick->pending = tick->jobUris.size();
+    for (size_t j = 0; j < tick->jobUris.size(); ++j) {
+      tracker.track(tick->jobUris[j], [tick, &freeTicks]() {
+        if (--tick->pending == 0) {
+          freeTicks.push(tick);
+        }
+      });
+    }
+  }
+  tracker.drain();
+  tracker.report();
+}
+
+} // namespace
+
+void runPipeline(random_generator &walk, int updateCount, int depth,
+                 FileSink *sink) {
+  std::vector<Tick> ticks(depth);
+  BoundedQueue<Tick *> freeTicks(depth);
+  BoundedQueue<Tick *> toSerialize(depth);
+  BoundedQueue<Tick *> toSend(depth);
+  BoundedQueue<Tick *> toTrack(depth);
+  for (size_t i = 0; i < ticks.size(); ++i) {
+    freeTicks.push(&ticks[i]);
+  }
+
+  std::thread serializer(serializeStage, std::ref(toSerialize),
+                         std::ref(toSend), std::ref(freeTicks));
+  std::thread sender, tracker;
+  if (sink) {
+    sender = std::thread(writeStage, std::ref(toSend), std::ref(freeTicks),
+                         std::ref(*sink));
+  } else {
+    sender = std::thread(sendStage, std::ref(toSend), std::ref(toTrack),
+                         std::ref(freeTicks));
+    tracker = std::thread(trackStage, std::ref(toTrack), std::ref(freeTicks));
+  }
+
+  TickScheduler scheduler;
+  const int first = static_cast<int>(entities.ticks);
+  for (int count = first; count < updateCount; ++count) {
+    if (count > first) {
+      scheduler.waitForNextTick();
+    }
+    Tick *tick;
+    if (!freeTicks.pop(tick)) {
+      break;
+    }
+    {
+      PhaseTimer timer(PHASE_SIMULATE);
+      stepEntities(walk);
+    }
+    metrics.add(COUNTER_TICKS);
+    LOG(LOG_DEBUG) << "Updating " << entities.size() << " entities";
+    tick->index = count;
+    tick->entities.snapshot(entities);
+    toSerialize.push(tick);
+  }
+  toSerialize.close();
+
+  serializer.join();
+  sender.join();
+  if (tracker.joinable()) {
+    tracker.join();
+  }
+  scheduler.report();
+
+  // Time simulate spent waiting for a free tick is backpressure from the rest
+  // of the pipeline; the stage with the least idle time is the bottleneck.
+  LOG(LOG_INFO) << "Pipeline: simulate blocked " << freeTicks.popWaitMs()
+                << " ms waiting for a free tick; idle time serialize "
+                << toSerialize.popWaitMs() << " ms, send "
+                << toSend.popWaitMs() << " ms, track " << toTrack.popWaitMs()
+                << " ms";
+}
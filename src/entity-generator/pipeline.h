@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "entity.h"
+#include "file-sink.h"
+#include "serialize.h"
+
+// A fixed-capacity FIFO connecting two pipeline stages.  push() blocks while
+// the queue is full and pop() while it is empty; the time consumers spend
+// blocked is recorded so stalls can be reported.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(capacity), closed_(false), popWait_(0) {}
+
+  // Blocks while the queue is full.  Returns false if the queue was closed.
+  bool push(const T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(item);
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  // Pops an item if one is available without blocking.
+  bool tryPop(T &item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (items_.empty()) {
+      return false;
+    }
+    item = items_.front();
+    items_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty.  Returns false once the queue has been
+  // closed and drained.
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (items_.empty() && !closed_) {
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      notEmpty_.wait(lock, [this] { return !items_.empty() || closed_; });
+      popWait_ += std::chrono::steady_clock::now() - start;
+    }
+    if (items_.empty()) {
+      return false;
+    }
+    item = items_.front();
+    items_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  // Wakes every blocked producer and consumer.  Items already queued can
+  // still be popped.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+  }
+
+  // Time consumers spent blocked on an empty queue (ms)
+  double popWaitMs() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::chrono::duration<double, std::milli>(popWait_).count();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable notFull_;
+  std::condition_variable notEmpty_;
+  std::deque<T> items_;
+  size_t capacity_;
+  bool closed_;
+  std::chrono::steady_clock::duration popWait_;
+};
+
+// One tick's worth of data as it moves through the pipeline.  Ticks are
+// recycled, so the entity snapshot and payload keep their storage from one
+// use to the next.
+struct Tick {
+  int index = 0;
+  EntityStore entities;
+  PayloadBuffer payload;
+  // Jobs of the tick's accepted add-data bodies
+  std::vector<std::string> jobUris;
+  // Bodies still being sent, then jobs still being followed
+  size_t pending = 0;
+};
+
+// Runs the ticks from entities.ticks up to updateCount with simulation,
+// serialization, upload and job tracking each on their own thread.  At most
+// depth ticks are in flight; once they all are, the simulation stage blocks
+// until job tracking hands one back.  Up to --max-in-flight uploads run
+// concurrently.  With a sink, bodies are written to it in place of the upload
+// and job tracking stages.  The simulation stage owns entities and walk, so
+// the data produced is identical to the serial loop.
+void runPipeline(random_generator &walk, int updateCount, int depth,
+                 FileSink *sink);
@@ -0,0 +1,319 @@
+#include "recording.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rapidjson/internal/itoa.h"
+
+#include "async-sender.h"
+#include "entity.h"
+#include "job-tracker.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace {
+
+const size_t WRITE_BUFFER_SIZE = 8 * 1024 * 1024;
+
+// Ends the name of every timestamp key in a body; the quote cannot appear
+// unescaped inside a string, so only keys match
+const char TIMESTAMP_KEY_END[] = "_ms\":";
+
+typedef std::chrono::steady_clock Clock;
+
+// Drives sender and tracker until due
+void driveUntil(AsyncSender &sender, JobTracker &tracker,
+                Clock::time_point due) {
+  while (true) {
+    Clock::time_point now = Clock::now();
+    if (now >= due) {
+      return;
+    }
+    if (sender.inFlight() == 0 && tracker.outstanding() == 0) {
+      std::this_thread::sleep_until(due);
+      return;
+    }
+    int timeoutMs = static_cast<int>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(due - now)
+            .count()) + 1;
+    // Neither may block for long while the other has work
+    if (sender.inFlight() > 0 && tracker.outstanding() > 0) {
+      timeoutMs = 1;
+    }
+    if (sender.inFlight() > 0) {
+      sender.poll(std::min(timeoutMs, 10));
+    }
+    if (tracker.outstanding() > 0) {
+      tracker.poll(std::min(timeoutMs, 10));
+    }
+  }
+}
+
+} // namespace
+
+RecordingWriter::RecordingWriter() : file_(NULL), offset_(0) {
+  memset(&header_, 0, sizeof(header_));
+}
+
+RecordingWriter::~RecordingWriter() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+bool RecordingWriter::open(const std::string &path) {
+  path_ = path;
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    LOG(LOG_ERROR) << "Unable to create " << path << ": " << strerror(errno);
+    return false;
+  }
+  buffer_.resize(WRITE_BUFFER_SIZE);
+  setvbuf(file_, &buffer_[0], _IOFBF, buffer_.size());
+
+  // The header is filled in by close(); until then the file starts with
+  // zeros
+  memset(&header_, 0, sizeof(header_));
+  strncpy(header_.compress, options.compress.c_str(),
+          sizeof(header_.compress) - 1);
+  char padding[RECORDING_DATA_OFFSET] = {0};
+  offset_ = 0;
+  return write(padding, sizeof(padding));
+}
+
+bool RecordingWriter::writeTick(uint64_t dueNs, uint64_t timestampMs,
+                                PayloadBuffer &payload) {
+  if (ticks_.empty()) {
+    header_.firstTimestampMs = timestampMs;
+  }
+  RecordedTick tick;
+  tick.dueNs = dueNs;
+  tick.firstBody = bodies_.size();
+  tick.bodyCount = payload.chunkCount();
+  ticks_.push_back(tick);
+
+  for (size_t c = 0; c < payload.chunkCount(); ++c) {
+    RecordedBody body;
+    body.offset = offset_;
+    body.size = payload.chunkSize(c);
+    body.entities = payload.chunkEntities[c];
+    bodies_.push_back(body);
+    if (!write(payload.data() + payload.chunkBegin(c), body.size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecordingWriter::close() {
+  // The index is aligned so it can be read in place once mapped
+  char padding[sizeof(uint64_t)] = {0};
+  if (!write(padding, (sizeof(uint64_t) - offset_ % sizeof(uint64_t)) %
+                          sizeof(uint64_t))) {
+    return false;
+  }
+  memcpy(header_.magic, RECORDING_MAGIC, sizeof(header_.magic));
+  header_.tickCount = ticks_.size();
+  header_.bodyCount = bodies_.size();
+  header_.indexOffset = offset_;
+  if (!write(ticks_.data(), ticks_.size() * sizeof(RecordedTick)) ||
+      !write(bodies_.data(), bodies_.size() * sizeof(RecordedBody))) {
+    return false;
+  }
+  if (fseek(file_, 0, SEEK_SET) != 0 ||
+      !write(&header_, sizeof(header_))) {
+    LOG(LOG_ERROR) << "Unable to write the header of " << path_;
+    return false;
+  }
+  int result = fclose(file_);
+  file_ = NULL;
+  if (result != 0) {
+    LOG(LOG_ERROR) << "Unable to write " << path_ << ": " << strerror(errno);
+    return false;
+  }
+  LOG(LOG_INFO) << "Recorded " << ticks_.size() << " ticks, "
+                << bodies_.size() << " bodies, " << header_.indexOffset
+                << " bytes of bodies to " << path_;
+  return true;
+}
+
+bool RecordingWriter::write(const void *data, size_t size) {
+  if (size > 0 && fwrite(data, 1, size, file_) != size) {
+    LOG(LOG_ERROR) << "Unable to write " << path_ << ": " << strerror(errno);
+    return false;
+  }
+  offset_ += size;
+  return true;
+}
+
+Recording::Recording()
+    : data_(NULL), size_(0), header_(NULL), ticks_(NULL), bodies_(NULL) {}
+
+Recording::~Recording() {
+  if (data_) {
+    munmap(const_cast<char *>(data_), size_);
+  }
+}
+
+bool Recording::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG(LOG_ERROR) << "Unable to open " << path << ": " << strerror(errno);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<uint64_t>(info.st_size) < RECORDING_DATA_OFFSET) {
+    LOG(LOG_ERROR) << path << " is not a recording";
+    ::close(fd);
+    return false;
+  }
+  size_ = info.st_size;
+  void *mapped = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG(LOG_ERROR) << "Unable to map " << path << ": " << strerror(errno);
+    return false;
+  }
+  data_ = static_cast<const char *>(mapped);
+  // Replays read the file front to back
+  madvise(mapped, size_, MADV_SEQUENTIAL);
+
+  header_ = reinterpret_cast<const RecordingHeader *>(data_);
+  if (memcmp(header_->magic, RECORDING_MAGIC, sizeof(RECORDING_MAGIC)) != 0) {
+    LOG(LOG_ERROR) << path << " is not a complete recording";
+    return false;
+  }
+  // The counts are bounded first so the index size cannot overflow
+  const uint64_t indexOffset = header_->indexOffset;
+  if (indexOffset % sizeof(uint64_t) != 0 || indexOffset > size_ ||
+      header_->tickCount > size_ || header_->bodyCount > size_ ||
+      header_->tickCount * sizeof(RecordedTick) +
+              header_->bodyCount * sizeof(RecordedBody) >
+          size_ - indexOffset ||
+      header_->compress[sizeof(header_->compress) - 1] != '\0') {
+    LOG(LOG_ERROR) << path << " has a corrupt header";
+    return false;
+  }
+  ticks_ = reinterpret_cast<const RecordedTick *>(data_ + indexOffset);
+  bodies_ = reinterpret_cast<const RecordedBody *>(ticks_ + header_->tickCount);
+  for (uint64_t t = 0; t < header_->tickCount; ++t) {
+    if (ticks_[t].firstBody > header_->bodyCount ||
+        ticks_[t].bodyCount > header_->bodyCount - ticks_[t].firstBody) {
+      LOG(LOG_ERROR) << path << " has a corrupt tick index";
+      return false;
+    }
+  }
+  for (uint64_t b = 0; b < header_->bodyCount; ++b) {
+    if (bodies_[b].offset < RECORDING_DATA_OFFSET ||
+        bodies_[b].offset > header_->indexOffset ||
+        bodies_[b].size > header_->indexOffset - bodies_[b].offset) {
+      LOG(LOG_ERROR) << path << " has a corrupt body index";
+      return false;
+    }
+  }
+  return true;
+}
+
+void rebaseTimestamps(const char *body, size_t size, int64_t deltaMs,
+                      std::string &out) {
+  const size_t keyEnd = sizeof(TIMESTAMP_KEY_END) - 1;
+  out.clear();
+  const char *end = body + size;
+  const char *next = body;
+  while (const char *key = static_cast<const char *>(
+             memmem(next, end - next, TIMESTAMP_KEY_END, keyEnd))) {
+    const char *digits = key + keyEnd;
+    out.append(next, digits - next);
+    uint64_t value = 0;
+    for (next = digits; next < end && *next >= '0' && *next <= '9'; ++next) {
+      value = value * 10 + (*next - '0');
+    }
+    int64_t rebased = static_cast<int64_t>(value) + deltaMs;
+    char number[24];
+    char *numberEnd = rapidjson::internal::u64toa(
+        rebased > 0 ? static_cast<uint64_t>(rebased) : 0, number);
+    out.append(number, numberEnd - number);
+  }
+  out.append(next, end - next);
+}
+
+void replayRecording(const Recording &recording) {
+  const RecordingHeader &header = recording.header();
+  const int64_t deltaMs =
+      options.replayRebase
+          ? static_cast<int64_t>(nowUTC()) -
+                static_cast<int64_t>(header.firstTimestampMs)
+          : 0;
+
+  AsyncSender sender(options.maxInFlight);
+  JobTracker tracker;
+  // Rebased copies of the bodies in flight, recycled as their POSTs finish
+  std::vector<std::unique_ptr<std::string>> spare;
+
+  const Clock::time_point start = Clock::now();
+  for (uint64_t t = 0; t < header.tickCount; ++t) {
+    const RecordedTick &tick = recording.tick(t);
+    if (options.replaySpeed > 0) {
+      driveUntil(sender, tracker,
+                 start + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::nanoseconds(static_cast<int64_t>(
+                                 tick.dueNs / options.replaySpeed))));
+    }
+    metrics.add(COUNTER_TICKS);
+    LOG(LOG_DEBUG) << "Replaying tick " << t;
+
+    for (uint64_t b = tick.firstBody; b < tick.firstBody + tick.bodyCount;
+         ++b) {
+      const RecordedBody &body = recording.body(b);
+      const char *data = recording.bodyData(body);
+      size_t size = body.size;
+      std::string *copy = NULL;
+      if (options.replayRebase) {
+        if (spare.empty()) {
+          spare.push_back(std::unique_ptr<std::string>(new std::string));
+        }
+        copy = spare.back().release();
+        spare.pop_back();
+        rebaseTimestamps(data, size, deltaMs, *copy);
+        data = copy->data();
+        size = copy->size();
+      }
+      const uint64_t entityCount = body.entities;
+      sender.post(data, size,
+                  [&tracker, &spare, copy, entityCount,
+                   size](const UploadResult &result) {
+                    if (copy) {
+                      spare.push_back(std::unique_ptr<std::string>(copy));
+                    }
+                    if (result.jobUri.empty()) {
+                      return;
+                    }
+                    metrics.add(COUNTER_ENTITIES, entityCount);
+                    metrics.add(COUNTER_BYTES, size);
+                    tracker.track(result.jobUri, []() {});
+                  });
+      // Keep the job polls going while the POSTs are
+      if (tracker.outstanding() > 0) {
+        tracker.poll(0);
+      }
+    }
+  }
+  sender.drain();
+  tracker.drain();
+
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  LOG(LOG_INFO) << "Replayed " << header.tickCount << " ticks, "
+                << header.bodyCount << " bodies in " << seconds << " s";
+  tracker.report();
+}
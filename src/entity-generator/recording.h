@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "serialize.h"
+
+// A recording (--record) holds serialized add-data bodies and when each tick
+// was due, so a workload can be generated once and replayed (--replay) many
+// times without simulating or serializing again.  The file is laid out as
+//
+//   RecordingHeader, padded to RECORDING_DATA_OFFSET
+//   the bodies, back to back, as they would have been sent
+//   RecordedTick[tickCount], then RecordedBody[bodyCount], at indexOffset
+//
+// in native byte order.  The header is written last, so an interrupted
+// recording is never mistaken for a complete one.
+
+const char RECORDING_MAGIC[8] = {'E', 'G', 'R', 'E', 'C', 0, 0, 1};
+const uint64_t RECORDING_DATA_OFFSET = 64;
+
+struct RecordingHeader {
+  char magic[8];
+  uint64_t tickCount;
+  uint64_t bodyCount;
+  uint64_t indexOffset;
+  // Timestamp of the first tick's entities, which --replay-rebase moves to
+  // the time the replay starts
+  uint64_t firstTimestampMs;
+  // The --compress codec the bodies were written with
+  char compress[16];
+};
+
+struct RecordedTick {
+  // When the tick was due, from the start of the run
+  uint64_t dueNs;
+  uint64_t firstBody;
+  uint64_t bodyCount;
+};
+
+struct RecordedBody {
+  // From the start of the file
+  uint64_t offset;
+  uint64_t size;
+  uint64_t entities;
+};
+
+// Writes a recording.  Bodies go through a large stdio buffer as they come;
+// the index is kept in memory and written by close().
+class RecordingWriter {
+public:
+  RecordingWriter();
+  ~RecordingWriter();
+
+  // Creates path.  Returns false, after logging, on failure.
+  bool open(const std::string &path);
+
+  // Appends every body of a tick that was due dueNs into the run
+  bool writeTick(uint64_t dueNs, uint64_t timestampMs,
+                 PayloadBuffer &payload);
+
+  // Writes the index and header and closes the file
+  bool close();
+
+private:
+  RecordingWriter(const RecordingWriter &);
+  RecordingWriter &operator=(const RecordingWriter &);
+
+  bool write(const void *data, size_t size);
+
+  std::string path_;
+  FILE *file_;
+  std::vector<char> buffer_;
+  uint64_t offset_;
+  RecordingHeader header_;
+  std::vector<RecordedTick> ticks_;
+  std::vector<RecordedBody> bodies_;
+};
+
+// A recording mapped into memory read-only, so bodies can be sent straight
+// from the page cache.
+class Recording {
+public:
+  Recording();
+  ~Recording();
+
+  // Maps path and checks its header and index.  Returns false, after
+  // logging, if it is not a complete recording.
+  bool open(const std::string &path);
+
+  const RecordingHeader &header() const { return *header_; }
+  const RecordedTick &tick(size_t index) const { return ticks_[index]; }
+  const RecordedBody &body(size_t index) const { return bodies_[index]; }
+  const char *bodyData(const RecordedBody &body) const {
+    return data_ + body.offset;
+  }
+
+private:
+  Recording(const Recording &);
+  Recording &operator=(const Recording &);
+
+  const char *data_;
+  size_t size_;
+  const RecordingHeader *header_;
+  const RecordedTick *ticks_;
+  const RecordedBody *bodies_;
+};
+
+// Copies size bytes of an uncompressed add-data body to out with every
+// timestamp_ms and endtime_ms moved by deltaMs
+void rebaseTimestamps(const char *body, size_t size, int64_t deltaMs,
+                      std::string &out);
+
+// Sends every body of recording to the add-data endpoint, ticks paced at
+// --replay-speed times the recorded rate (as fast as possible for 0), with up
+// to --max-in-flight POSTs outstanding, and follows their jobs.  With
+// --replay-rebase the timestamps are moved so the first tick is now.
+void replayRecording(const Recording &recording);
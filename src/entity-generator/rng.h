@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+
+#include <boost/random.hpp>
+
+// The random number sources behind --rng:
+//
+//   mt19937  one boost::mt19937 shared by every entity, drawn in entity order.
+//            Start locations use seeds 1 and 2 and the walk seed 0, exactly
+//            as before the other sources existed, so old runs reproduce.
+//   stream   a splitmix64 stream per entity (EntityWalk), seeded by --seed.
+//   philox   Philox4x32-10 (Salmon et al., SC'11) keyed by --seed and
+//            counting (entity, tick), so any entity's draws at any tick can
+//            be computed directly, in any order, on any thread.
+
+typedef boost::variate_generator<boost::mt19937,
+                                 boost::random::uniform_real_distribution<>>
+    random_generator;
+
+// Maps the top 53 bits of bits to a uniform double in [min, max)
+inline double uniformDouble(uint64_t bits, double min, double max) {
+  double u = (bits >> 11) * (1.0 / 9007199254740992.0);
+  return min + (max - min) * u;
+}
+
+// A random walk stream private to one entity, so entities can be moved in
+// any order or on any thread and still get the same draws.  The stream is
+// splitmix64, seeded from --seed and the entity's index.
+class EntityWalk {
+public:
+  EntityWalk(uint64_t &state, double min, double max)
+      : state_(state), min_(min), max_(max) {}
+
+  static uint64_t seedFor(uint64_t seed, uint64_t index) {
+    uint64_t state = seed ^ (index * 0xD1B54A32D192ED03ULL);
+    return next(state);
+  }
+
+  double operator()() { return uniformDouble(next(state_), min_, max_); }
+
+private:
+  static uint64_t next(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t &state_;
+  double min_;
+  double max_;
+};
+
+// Philox4x32-10: ten rounds of a keyed bijection over a 128-bit counter.
+// Each block yields two 64-bit draws.
+namespace philox {
+
+const uint32_t M0 = 0xD2511F53;
+const uint32_t M1 = 0xCD9E8D57;
+const uint32_t W0 = 0x9E3779B9;
+const uint32_t W1 = 0xBB67AE85;
+const int ROUNDS = 10;
+
+// The tick whose draws place entities at their start locations; real ticks
+// count up from zero and never reach it.
+const uint64_t START_TICK = ~0ULL;
+
+inline void block(uint64_t seed, uint64_t entity, uint64_t tick,
+                  uint64_t &first, uint64_t &second) {
+  uint32_t c0 = static_cast<uint32_t>(entity);
+  uint32_t c1 = static_cast<uint32_t>(entity >> 32);
+  uint32_t c2 = static_cast<uint32_t>(tick);
+  uint32_t c3 = static_cast<uint32_t>(tick >> 32);
+  uint32_t k0 = static_cast<uint32_t>(seed);
+  uint32_t k1 = static_cast<uint32_t>(seed >> 32);
+  for (int round = 0; round < ROUNDS; ++round) {
+    uint64_t p0 = static_cast<uint64_t>(M0) * c0;
+    uint64_t p1 = static_cast<uint64_t>(M1) * c2;
+    uint32_t next0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+    uint32_t next2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+    c1 = static_cast<uint32_t>(p1);
+    c3 = static_cast<uint32_t>(p0);
+    c0 = next0;
+    c2 = next2;
+    k0 += W0;
+    k1 += W1;
+  }
+  first = static_cast<uint64_t>(c0) << 32 | c1;
+  second = static_cast<uint64_t>(c2) << 32 | c3;
+}
+
+// Entity's latitude and longitude deltas, uniform in [min, max), at tick
+inline void walkDeltas(uint64_t seed, uint64_t entity, uint64_t tick,
+                       double min, double max, double &dLat, double &dLng) {
+  uint64_t first, second;
+  block(seed, entity, tick, first, second);
+  dLat = uniformDouble(first, min, max);
+  dLng = uniformDouble(second, min, max);
+}
+
+} // namespace philox
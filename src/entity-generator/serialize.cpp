@@ -0,0 +1,240 @@
+#include "serialize.h"
+
+#include <chrono>
+
+#include "rapidjson/writer.h"
+
+#include "metrics.h"
+
+namespace {
+
+// Clears the payload and reserves room for the largest payload seen so far
+// plus some headroom, so a slightly larger tick does not trigger a grow and
+// copy of the whole buffer halfway through serialization.
+void beginPayload(PayloadBuffer &buffer) {
+  buffer.json.Clear();
+  buffer.json.Reserve(buffer.highWaterMark + buffer.highWaterMark / 8);
+}
+
+void endPayload(PayloadBuffer &buffer) {
+  buffer.jsonSize = buffer.json.GetSize();
+  if (buffer.jsonSize > buffer.highWaterMark) {
+    buffer.highWaterMark = buffer.jsonSize;
+  }
+}
+
+// Largest output of Writer::Uint64() and Writer::Double()
+const size_t MAX_UINT64_CHARS = 20;
+const size_t MAX_DOUBLE_CHARS = 25;
+// What closes a body: "]}"
+const size_t BODY_CLOSE_BYTES = 2;
+
+// An upper bound on the JSON for one entity of kind, including the separator
+// before it
+size_t maxEntityBytes(const std::string &kind) {
+  static const char FRAME[] = ",{\"identity\":\"\",\"timestamp_ms\":,"
+                              "\"endtime_ms\":,\"kind\":\"\",\"path\":"
+                              "[{\"x\":,\"y\":,\"z\":}]}";
+  // Escaping can turn each byte of the kind into \u00XX
+  return sizeof(FRAME) - 1 + MAX_ENTITY_ID_LENGTH + 2 * MAX_UINT64_CHARS +
+         3 * MAX_DOUBLE_CHARS + 6 * kind.size();
+}
+
+size_t bytesWritten(const rapidjson::StringBuffer &stream) {
+  return stream.GetSize();
+}
+
+size_t bytesWritten(const PayloadCompressor &stream) {
+  return stream.bytesIn();
+}
+
+// Whether a body already holding count entities in bytes bytes must be closed
+// before an entity of kind is added to it
+bool chunkFull(size_t count, size_t bytes, const std::string &kind) {
+  if (options.maxBatchEntities > 0 &&
+      count >= static_cast<size_t>(options.maxBatchEntities)) {
+    return true;
+  }
+  return options.maxBatchBytes > 0 &&
+         bytes + maxEntityBytes(kind) + BODY_CLOSE_BYTES >
+             options.maxBatchBytes;
+}
+
+// Writes one add-data body holding entities from begin on, and returns the
+// index of the first entity it did not take.
+template <typename Stream>
+size_t writeChunk(const EntityStore &entities, size_t begin, Stream &stream) {
+  rapidjson::Writer<Stream> writer(stream);
+  const size_t start = bytesWritten(stream);
+
+  writer.StartObject();
+  writer.Key("entities");
+  writer.StartArray();
+  char id[MAX_ENTITY_ID_LENGTH];
+  size_t i = begin;
+  for (; i < entities.size(); ++i) {
+    const std::string &kind = entities.kinds[entities.kindIndex[i]];
+    if (i > begin && chunkFull(i - begin, bytesWritten(stream) - start, kind)) {
+      break;
+    }
+    writer.StartObject();
+    writer.Key("identity");
+    writer.String(id, formatEntityId(i, id));
+    writer.Key("timestamp_ms");
+    writer.Uint64(entities.timestamp[i]);
+    writer.Key("endtime_ms");
+    writer.Uint64(entities.timestamp[i] + options.endtimeOffset);
+    writer.Key("kind");
+    writer.String(kind.c_str(), kind.size());
+    writer.Key("path");
+    writer.StartArray();
+    writer.StartObject();
+    writer.Key("x");
+    writer.Double(entities.longitude[i]);
+    writer.Key("y");
+    writer.Double(entities.latitude[i]);
+    writer.Key("z");
+    writer.Double(entities.altitude[i]);
+    writer.EndObject();
+    writer.EndArray();
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+  return i;
+}
+
+const size_t MIN_DOM_ARENA_SIZE = 64 * 1024;
+
+} // namespace
+
+rapidjson::Value getJsonPath(std::array<double, 3> location,
+                             rapidjson::Document::AllocatorType &allocator) {
+  rapidjson::Value jsonLoc(rapidjson::kObjectType);
+  jsonLoc.AddMember("x", rapidjson::Value(location[0]), allocator);
+  jsonLoc.AddMember("y", rapidjson::Value(location[1]), allocator);
+  jsonLoc.AddMember("z", rapidjson::Value(location[2]), allocator);
+  rapidjson::Value path(rapidjson::kArrayType);
+  path.PushBack(jsonLoc, allocator);
+  return path;
+}
+
+void serializeEntitiesDom(const EntityStore &entities, PayloadBuffer &buffer) {
+  if (buffer.domArena.size() < MIN_DOM_ARENA_SIZE) {
+    buffer.domArena.resize(MIN_DOM_ARENA_SIZE);
+  }
+
+  size_t arenaUsed = 0;
+  {
+    rapidjson::MemoryPoolAllocator<> allocator(&buffer.domArena[0],
+                                               buffer.domArena.size());
+    rapidjson::Document jsonDoc(&allocator);
+    jsonDoc.SetObject();
+
+    rapidjson::Value jsonEntities(rapidjson::kArrayType);
+
+    char id[MAX_ENTITY_ID_LENGTH];
+    for (size_t i = 0; i < entities.size(); ++i) {
+      const std::string &kind = entities.kinds[entities.kindIndex[i]];
+      std::array<double, 3> location = {
+          {entities.longitude[i], entities.latitude[i], entities.altitude[i]}};
+      rapidjson::Value newEntity(rapidjson::kObjectType);
+      newEntity.AddMember(
+          "identity",
+          rapidjson::Value(id, formatEntityId(i, id), jsonDoc.GetAllocator()),
+          jsonDoc.GetAllocator());
+      newEntity.AddMember("timestamp_ms",
+                          rapidjson::Value(entities.timestamp[i]),
+                          jsonDoc.GetAllocator());
+      newEntity.AddMember(
+          "endtime_ms",
+          rapidjson::Value(entities.timestamp[i] + options.endtimeOffset),
+          jsonDoc.GetAllocator());
+      newEntity.AddMember("kind", rapidjson::Value(kind.c_str(), kind.size()),
+                          jsonDoc.GetAllocator());
+      newEntity.AddMember("path",
+                          getJsonPath(location, jsonDoc.GetAllocator()),
+                          jsonDoc.GetAllocator());
+      jsonEntities.PushBack(newEntity, jsonDoc.GetAllocator());
+    }
+    jsonDoc.AddMember("entities", jsonEntities, jsonDoc.GetAllocator());
+
+    beginPayload(buffer);
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer.json);
+    jsonDoc.Accept(writer);
+    endPayload(buffer);
+
+    arenaUsed = allocator.Size();
+  }
+
+  if (buffer.compressor) {
+    buffer.compressed.Clear();
+    buffer.compressor->begin(buffer.compressed);
+    buffer.compressor->write(buffer.json.GetString(), buffer.json.GetSize());
+    buffer.compressor->end();
+  }
+  buffer.chunkEnds.assign(1, buffer.size());
+  buffer.chunkEntities.assign(1, entities.size());
+
+  // Anything that spilled out of the arena went to heap chunks this tick; grow
+  // the arena so the next tick fits in it.
+  if (arenaUsed > buffer.domArena.size()) {
+    buffer.domArena.resize(arenaUsed + arenaUsed / 8);
+  }
+}
+
+void serializeEntities(const EntityStore &entities, PayloadBuffer &buffer) {
+  buffer.chunkEnds.clear();
+  buffer.chunkEntities.clear();
+  size_t next = 0;
+  if (buffer.compressor) {
+    buffer.compressed.Clear();
+    buffer.jsonSize = 0;
+    do {
+      size_t begin = next;
+      buffer.compressor->begin(buffer.compressed);
+      next = writeChunk(entities, next, *buffer.compressor);
+      buffer.jsonSize += buffer.compressor->end();
+      buffer.chunkEnds.push_back(buffer.compressed.GetSize());
+      buffer.chunkEntities.push_back(next - begin);
+    } while (next < entities.size());
+    return;
+  }
+  beginPayload(buffer);
+  do {
+    size_t begin = next;
+    next = writeChunk(entities, next, buffer.json);
+    buffer.chunkEnds.push_back(buffer.json.GetSize());
+    buffer.chunkEntities.push_back(next - begin);
+  } while (next < entities.size());
+  endPayload(buffer);
+}
+
+void serializePayload(const EntityStore &entities, PayloadBuffer &buffer) {
+  if (options.compress != "none" && !buffer.compressor) {
+    buffer.compressor.reset(
+        new PayloadCompressor(options.compress, options.compressLevel));
+  }
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::duration codecStart =
+      buffer.compressor ? buffer.compressor->codecTime()
+                        : std::chrono::steady_clock::duration(0);
+  if (options.serializer == "dom") {
+    serializeEntitiesDom(entities, buffer);
+  } else {
+    serializeEntities(entities, buffer);
+  }
+
+  // Streaming compression runs inside the serializer, so the codec's share is
+  // taken out of the serialize phase and recorded on its own
+  std::chrono::steady_clock::duration total =
+      std::chrono::steady_clock::now() - start;
+  if (buffer.compressor) {
+    std::chrono::steady_clock::duration codec =
+        buffer.compressor->codecTime() - codecStart;
+    metrics.record(PHASE_COMPRESS, codec);
+    total -= codec;
+  }
+  metrics.record(PHASE_SERIALIZE, total);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "compress.h"
+#include "entity.h"
+
+// The add-data request body for one tick, along with the arena used by the DOM
+// serializer.  Both live for the whole run: once the first few ticks have
+// sized them, serializing a tick no longer allocates.  With a compressor the
+// body is compressed; the SAX serializer then writes no uncompressed JSON.
+struct PayloadBuffer {
+  rapidjson::StringBuffer json;
+  rapidjson::StringBuffer compressed;
+  std::unique_ptr<PayloadCompressor> compressor;
+  std::vector<char> domArena;
+  // Largest payload serialized into this buffer so far
+  size_t highWaterMark = 0;
+  // Size of the last payload before compression
+  size_t jsonSize = 0;
+  // Where each add-data body ends in data().  --max-batch-bytes and
+  // --max-batch-entities split a tick into several bodies, laid out back to
+  // back; otherwise there is one.
+  std::vector<size_t> chunkEnds;
+  // How many entities each body holds
+  std::vector<size_t> chunkEntities;
+
+  const char *data() {
+    return compressor ? compressed.GetString() : json.GetString();
+  }
+  size_t size() const {
+    return compressor ? compressed.GetSize() : json.GetSize();
+  }
+
+  size_t chunkCount() const { return chunkEnds.size(); }
+  size_t chunkBegin(size_t chunk) const {
+    return chunk == 0 ? 0 : chunkEnds[chunk - 1];
+  }
+  size_t chunkSize(size_t chunk) const {
+    return chunkEnds[chunk] - chunkBegin(chunk);
+  }
+};
+
+rapidjson::Value getJsonPath(std::array<double, 3> location,
+                             rapidjson::Document::AllocatorType &allocator);
+
+// Builds a rapidjson::Document for the add-data request in buffer.domArena and
+// writes it to buffer.  Kept for comparison with serializeEntities(); selected
+// with --serializer=dom.
+void serializeEntitiesDom(const EntityStore &entities, PayloadBuffer &buffer);
+
+// Writes the add-data request for entities to buffer by driving a
+// rapidjson::Writer directly from the entity state.  The output is
+// byte-identical to serializeEntitiesDom().  A new body is started whenever
+// the next entity could take the current one past --max-batch-bytes (before
+// compression) or --max-batch-entities; every body holds at least one entity.
+void serializeEntities(const EntityStore &entities, PayloadBuffer &buffer);
+
+// Serializes entities with the strategy selected by --serializer, compressed
+// as selected by --compress, and records the serialize and compress phases
+void serializePayload(const EntityStore &entities, PayloadBuffer &buffer);
@@ -0,0 +1,392 @@
+#include "shard.h"
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "entity.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int SHARD_INDEX_DIGITS = 2;
+const int POLL_INTERVAL_MS = 200;
+const std::chrono::milliseconds PROGRESS_INTERVAL(500);
+
+enum ShardState { SHARD_RUNNING, SHARD_DONE, SHARD_FAILED };
+
+struct Shard {
+  int first;
+  int end;
+  pid_t pid;
+  // Read end of the worker's --progress-fd; -1 once it has closed
+  int progress;
+  std::string partial;
+  int attempts;
+  ShardState state;
+  // Reported by the current attempt
+  uint64_t ticks;
+  uint64_t entities;
+  uint64_t bytes;
+  // Sent by earlier attempts, which count as sent even though they failed
+  uint64_t earlierEntities;
+  uint64_t earlierBytes;
+};
+
+struct Totals {
+  Clock::time_point time;
+  uint64_t ticks;
+  uint64_t entities;
+  uint64_t bytes;
+};
+
+std::string describeStatus(int status) {
+  std::ostringstream text;
+  if (WIFEXITED(status)) {
+    text << "exited with status " << WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    text << "was killed by signal " << WTERMSIG(status);
+  } else {
+    text << "stopped with wait status " << status;
+  }
+  return text.str();
+}
+
+std::string option(const char *name, const std::string &value) {
+  return std::string("--") + name + "=" + value;
+}
+
+std::string option(const char *name, int value) {
+  std::ostringstream text;
+  text << value;
+  return option(name, text.str());
+}
+
+// Starts a worker for shard index.  Returns false, after logging, if it could
+// not be started.
+bool launch(const std::vector<std::string> &args, int index, Shard &shard) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    LOG(LOG_ERROR) << "Unable to create a pipe for shard " << index << ": "
+                   << strerror(errno);
+    return false;
+  }
+
+  std::vector<std::string> workerArgs(1, "entity-generator");
+  workerArgs.insert(workerArgs.end(), args.begin(), args.end());
+  workerArgs.push_back(option("start-tick", shard.first));
+  workerArgs.push_back(option("end-tick", shard.end));
+  workerArgs.push_back(option("progress-fd", fds[1]));
+  if (!options.output.empty()) {
+    workerArgs.push_back(option("output", shardPath(options.output, index)));
+  }
+  if (!options.record.empty()) {
+    workerArgs.push_back(option("record", shardPath(options.record, index)));
+  }
+  if (!options.checkpoint.empty()) {
+    workerArgs.push_back(
+        option("checkpoint", shardPath(options.checkpoint, index)));
+    // A retry carries on from the shard's last checkpoint
+    if (options.resume || shard.attempts > 0) {
+      workerArgs.push_back("--resume");
+    }
+  }
+  if (options.metricsPort > 0) {
+    workerArgs.push_back(
+        option("metrics-port", options.metricsPort + 1 + index));
+  }
+  // Built before forking: the child may only make async-signal-safe calls
+  std::vector<char *> argv;
+  for (size_t i = 0; i < workerArgs.size(); ++i) {
+    argv.push_back(const_cast<char *>(workerArgs[i].c_str()));
+  }
+  argv.push_back(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG(LOG_ERROR) << "Unable to start shard " << index << ": "
+                   << strerror(errno);
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // Workers should not outlive the coordinator
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    fcntl(fds[1], F_SETFD, 0);
+    execv("/proc/self/exe", &argv[0]);
+    _exit(127);
+  }
+  close(fds[1]);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  shard.pid = pid;
+  shard.progress = fds[0];
+  shard.partial.clear();
+  shard.ticks = 0;
+  shard.entities = 0;
+  shard.bytes = 0;
+  shard.state = SHARD_RUNNING;
+  ++shard.attempts;
+  LOG(LOG_INFO) << "Shard " << index << " (ticks " << shard.first << " to "
+                << shard.end << ") started as pid " << pid
+                << (shard.attempts > 1 ? ", retrying" : "");
+  return true;
+}
+
+// Reads whatever progress the shard's worker has reported, closing the pipe
+// once the worker has
+void readProgress(Shard &shard) {
+  char buffer[4096];
+  while (shard.progress >= 0) {
+    ssize_t length = read(shard.progress, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+    if (length <= 0) {
+      if (length == 0 || errno != EAGAIN) {
+        close(shard.progress);
+        shard.progress = -1;
+      }
+      return;
+    }
+    shard.partial.append(buffer, length);
+    size_t newline;
+    while ((newline = shard.partial.find('\n')) != std::string::npos) {
+      unsigned long long ticks, entities, bytes;
+      if (sscanf(shard.partial.c_str(), "%llu %llu %llu", &ticks, &entities,
+                 &bytes) == 3) {
+        shard.ticks = ticks;
+        shard.entities = entities;
+        shard.bytes = bytes;
+      }
+      shard.partial.erase(0, newline + 1);
+    }
+  }
+}
+
+Totals total(const std::vector<Shard> &shards) {
+  Totals totals;
+  totals.time = Clock::now();
+  totals.ticks = 0;
+  totals.entities = 0;
+  totals.bytes = 0;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    const Shard &shard = shards[i];
+    totals.ticks += shard.state == SHARD_DONE
+                        ? static_cast<uint64_t>(shard.end - shard.first)
+                        : shard.ticks;
+    totals.entities += shard.earlierEntities + shard.entities;
+    totals.bytes += shard.earlierBytes + shard.bytes;
+  }
+  return totals;
+}
+
+void report(const char *label, const std::vector<Shard> &shards,
+            int retries, uint64_t tickCount, const Totals &from,
+            const Totals &to) {
+  int running = 0, done = 0, failed = 0;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    running += shards[i].state == SHARD_RUNNING;
+    done += shards[i].state == SHARD_DONE;
+    failed += shards[i].state == SHARD_FAILED;
+  }
+  const double elapsed = std::chrono::duration<double>(to.time - from.time)
+                             .count();
+  const uint64_t entities = to.entities - from.entities;
+  const uint64_t bytes = to.bytes - from.bytes;
+  LOG(LOG_INFO) << "Shards (" << label << "): " << running << " running, "
+                << done << " done, " << failed << " failed, " << retries
+                << " retried; ticks " << to.ticks << " of " << tickCount
+                << " (" << 100.0 * to.ticks / tickCount << "%), entities "
+                << entities << " ("
+                << (elapsed > 0 ? entities / elapsed : 0) << "/s), bytes "
+                << bytes << " (" << (elapsed > 0 ? bytes / elapsed : 0)
+                << "/s)";
+}
+
+} // namespace
+
+std::string shardPath(const std::string &path, int shard) {
+  char number[16];
+  snprintf(number, sizeof(number), "-shard%0*d", SHARD_INDEX_DIGITS, shard);
+  size_t slash = path.rfind('/');
+  size_t base = slash == std::string::npos ? 0 : slash + 1;
+  size_t dot = path.find('.', base);
+  if (dot == std::string::npos || dot == base) {
+    return path + number;
+  }
+  return path.substr(0, dot) + number + path.substr(dot);
+}
+
+int runShards(const std::vector<std::string> &args, int firstTick,
+              int endTick) {
+  const int64_t tickCount = endTick - firstTick;
+  if (tickCount <= 0) {
+    LOG(LOG_ERROR) << "No ticks to split: --start-tick is past the end of "
+                   << "the run";
+    return 1;
+  }
+  int shardCount = options.shards;
+  if (shardCount > tickCount) {
+    shardCount = static_cast<int>(tickCount);
+  }
+  LOG(LOG_INFO) << "Splitting ticks " << firstTick << " to " << endTick
+                << " between " << shardCount << " shards";
+
+  std::vector<Shard> shards(shardCount);
+  for (int i = 0; i < shardCount; ++i) {
+    Shard &shard = shards[i];
+    shard.first = static_cast<int>(firstTick + tickCount * i / shardCount);
+    shard.end = static_cast<int>(firstTick + tickCount * (i + 1) / shardCount);
+    shard.pid = -1;
+    shard.progress = -1;
+    shard.attempts = 0;
+    shard.state = SHARD_FAILED;
+    shard.ticks = shard.entities = shard.bytes = 0;
+    shard.earlierEntities = shard.earlierBytes = 0;
+  }
+
+  int running = 0;
+  int retries = 0;
+  for (int i = 0; i < shardCount; ++i) {
+    running += launch(args, i, shards[i]);
+  }
+
+  const Clock::duration interval =
+      std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(options.metricsInterval));
+  const Totals start = total(shards);
+  Totals previous = start;
+  while (running > 0) {
+    std::vector<pollfd> fds;
+    std::vector<int> owners;
+    for (int i = 0; i < shardCount; ++i) {
+      if (shards[i].progress >= 0) {
+        pollfd fd = {shards[i].progress, POLLIN, 0};
+        fds.push_back(fd);
+        owners.push_back(i);
+      }
+    }
+    if (poll(fds.data(), fds.size(), POLL_INTERVAL_MS) > 0) {
+      for (size_t f = 0; f < fds.size(); ++f) {
+        if (fds[f].revents) {
+          readProgress(shards[owners[f]]);
+        }
+      }
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      int index = 0;
+      while (index < shardCount && shards[index].pid != pid) {
+        ++index;
+      }
+      if (index == shardCount) {
+        continue;
+      }
+      Shard &shard = shards[index];
+      // Whatever the worker wrote before exiting is still in the pipe
+      readProgress(shard);
+      if (shard.progress >= 0) {
+        close(shard.progress);
+        shard.progress = -1;
+      }
+      shard.pid = -1;
+      --running;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        shard.state = SHARD_DONE;
+        LOG(LOG_INFO) << "Shard " << index << " finished";
+        continue;
+      }
+      shard.earlierEntities += shard.entities;
+      shard.earlierBytes += shard.bytes;
+      shard.entities = shard.bytes = 0;
+      shard.state = SHARD_FAILED;
+      if (shard.attempts > options.shardRetries) {
+        LOG(LOG_ERROR) << "Shard " << index << " "
+                       << describeStatus(status) << "; giving up after "
+                       << shard.attempts << " attempts";
+        continue;
+      }
+      LOG(LOG_WARN) << "Shard " << index << " " << describeStatus(status)
+                    << "; retrying";
+      ++retries;
+      running += launch(args, index, shard);
+    }
+
+    if (options.metricsInterval > 0 &&
+        Clock::now() - previous.time >= interval) {
+      Totals current = total(shards);
+      std::ostringstream label;
+      label << "last " << options.metricsInterval << " s";
+      report(label.str().c_str(), shards, retries, tickCount, previous,
+             current);
+      previous = current;
+    }
+  }
+
+  report("whole run", shards, retries, tickCount, start, total(shards));
+  for (int i = 0; i < shardCount; ++i) {
+    if (shards[i].state != SHARD_DONE) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+ShardProgress::ShardProgress() : running_(false) {
+  if (options.progressFd >= 0) {
+    running_ = true;
+    thread_ = std::thread(&ShardProgress::run, this);
+  }
+}
+
+ShardProgress::~ShardProgress() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    wake_.notify_all();
+  }
+  thread_.join();
+  write();
+  close(options.progressFd);
+}
+
+void ShardProgress::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!wake_.wait_for(lock, PROGRESS_INTERVAL,
+                         [this] { return !running_; })) {
+    write();
+  }
+}
+
+void ShardProgress::write() const {
+  char line[80];
+  int length = snprintf(
+      line, sizeof(line), "%llu %llu %llu\n",
+      static_cast<unsigned long long>(metrics.count(COUNTER_TICKS)),
+      static_cast<unsigned long long>(metrics.count(COUNTER_ENTITIES)),
+      static_cast<unsigned long long>(metrics.count(COUNTER_BYTES)));
+  // The coordinator only wants the latest counts, so a short write is not
+  // retried
+  if (::write(options.progressFd, line, length) < 0) {
+    LOG(LOG_DEBUG) << "Unable to report progress: " << strerror(errno);
+  }
+}
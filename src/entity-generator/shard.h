@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// --shards splits the ticks of a non-live run into contiguous ranges and runs
+// each as its own entity-generator process, started with --start-tick and
+// --end-tick, so a long backfill uses every core.  Each shard has its own
+// upload pipeline (or --output, --record and --checkpoint files, named by
+// shardPath()).  The coordinator aggregates the shards' progress, which they
+// report over a pipe, and restarts a shard that fails up to --shard-retries
+// times.  A restarted shard starts its range again unless it resumes from
+// its own --checkpoint, so ticks it had sent before failing may be sent
+// twice.
+
+// path with the shard's number before its extensions: run.ndjson.gz becomes
+// run-shard03.ndjson.gz
+std::string shardPath(const std::string &path, int shard);
+
+// Runs --shards workers over the ticks [firstTick, endTick).  args are the
+// command line options to pass on to each, less those naming the shard's
+// range and files.  Returns the process exit status: 0 once every shard has
+// finished, 1 if any failed for good.
+int runShards(const std::vector<std::string> &args, int firstTick,
+              int endTick);
+
+// Writes this process's tick, entity and byte counts to --progress-fd every
+// half second, and once more when destroyed, for the coordinator.  Does
+// nothing without --progress-fd.
+class ShardProgress {
+public:
+  ShardProgress();
+  ~ShardProgress();
+
+private:
+  ShardProgress(const ShardProgress &);
+  ShardProgress &operator=(const ShardProgress &);
+
+  void run();
+  void write() const;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool running_;
+};
@@ -0,0 +1,248 @@
+#include "upload.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include "rapidjson/document.h"
+
+#include "entity.h"
+#include "log.h"
+#include "metrics.h"
+
+// A function that dumps response data from a curl request into the provided
+// std::string
+size_t writefunc(void *ptr, size_t size, size_t nmemb, std::string *s) {
+  s->append((char *)ptr, size * nmemb);
+  // std::cout << *s << std::endl;
+  return size * nmemb;
+}
+
+// A function that dumps response headers from a curl request into the provided
+// map
+// The map will store header keys and their associated values
+size_t headerfunc(void *ptr, size_t size, size_t nitems,
+                  std::map<std::string, std::string> *m) {
+  std::string data((char *)ptr, size * nitems);
+  // Only the first colon ends the name; values such as an absolute Location
+  // have their own
+  size_t colon = data.find(':');
+  if (colon != std::string::npos) {
+    (*m)[boost::algorithm::trim_copy(data.substr(0, colon))] =
+        boost::algorithm::trim_copy(data.substr(colon + 1));
+  }
+
+  return size * nitems;
+}
+
+bool parseJobStatus(const char *json, long &response, std::string &result) {
+  // The response for a job status query is a json structure containing at
+  // least a 'progress' field (floating point value between 0.0 and 1.0
+  // indicating percentage complete)
+  // When the job is complete, it will also contain a 'response' field
+  // containing an http response code (200 is success for an add_data
+  // call)
+  // and a 'result' field containing a string with any useful response
+  // output (like an error message)
+  rapidjson::Document d;
+  d.Parse(json);
+  if (d.HasParseError() || !d.IsObject() || !d.HasMember("response") ||
+      !d["response"].IsInt()) {
+    return false;
+  }
+  response = d["response"].GetInt();
+  if (d.HasMember("result") && d["result"].IsString()) {
+    result.assign(d["result"].GetString(), d["result"].GetStringLength());
+  } else {
+    result.clear();
+  }
+  return true;
+}
+
+std::string getAddDataUrl() {
+  return options.baseUrl + "/conduce/api/v1/datasets/add-data/" +
+         options.dataset;
+}
+
+std::string getJobUrl(const std::string &jobUri) {
+  if (jobUri.compare(0, 7, "http://") == 0 ||
+      jobUri.compare(0, 8, "https://") == 0) {
+    return jobUri;
+  }
+  // The location header from an asynchronous call gives the relative URI,
+  // starting at /conduce/api, so we need to prepend the base URL.  A path
+  // prefix is kept, for proxies that serve the API below one.
+  return options.baseUrl + jobUri;
+}
+
+bool initUploadHandle(UploadHandle &handle) {
+  handle.curl = curl_easy_init();
+  if (!handle.curl) {
+    return false;
+  }
+  CURL *curl = handle.curl;
+  handle.url = getAddDataUrl();
+  curl_easy_setopt(curl, CURLOPT_URL, handle.url.c_str());
+  handle.requestHeaders =
+      curl_slist_append(handle.requestHeaders, "Content-Type: application/json");
+  if (options.compress != "none") {
+    std::string encodingHeader = "Content-Encoding: " + options.compress;
+    handle.requestHeaders =
+        curl_slist_append(handle.requestHeaders, encodingHeader.c_str());
+  }
+  std::string keyHeader = "Authorization: Bearer " + options.apiKey;
+  handle.requestHeaders =
+      curl_slist_append(handle.requestHeaders, keyHeader.c_str());
+  handle.requestHeaders = curl_slist_append(handle.requestHeaders, "Expect:");
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle.requestHeaders);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, handle.errorBuffer);
+  if (options.insecure) {
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+  }
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &handle.response);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerfunc);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &handle.headers);
+  if (options.disableSslVerifyPeer) {
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+  }
+  if (!options.unixSocket.empty()) {
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH,
+                     options.unixSocket.c_str());
+  }
+  if (const char *cainfo = std::getenv("REQUESTS_CA_BUNDLE")) {
+    curl_easy_setopt(curl, CURLOPT_CAINFO, cainfo);
+  }
+  return true;
+}
+
+void cleanupUploadHandle(UploadHandle &handle) {
+  curl_easy_cleanup(handle.curl);
+  curl_slist_free_all(handle.requestHeaders);
+  handle.curl = NULL;
+  handle.requestHeaders = NULL;
+}
+
+void prepareAddDataRequest(UploadHandle &handle, const char *body,
+                           size_t size) {
+  CURL *curl = handle.curl;
+  handle.response.clear();
+  handle.headers.clear();
+
+  LOG(LOG_DEBUG) << handle.url;
+  // Reset all of the curl fields for the next add_data call
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, handle.errorBuffer);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &handle.response);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &handle.headers);
+  curl_easy_setopt(curl, CURLOPT_URL, handle.url.c_str());
+  // Hand libcurl the buffer itself rather than a copy of it
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                   static_cast<curl_off_t>(size));
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+  curl_easy_setopt(curl, CURLOPT_POST, 1);
+  handle.errorBuffer[0] = 0;
+}
+
+void recordAttempt(UploadHandle &handle, CURLcode res) {
+  metrics.add(COUNTER_REQUESTS);
+  if (res != CURLE_OK) {
+    metrics.add(COUNTER_TRANSPORT_ERRORS);
+    return;
+  }
+  long responseCode = 0;
+  curl_easy_getinfo(handle.curl, CURLINFO_RESPONSE_CODE, &responseCode);
+  if (responseCode / 100 == 5) {
+    metrics.add(COUNTER_SERVER_ERRORS);
+  }
+  curl_off_t totalUs = 0;
+  curl_easy_getinfo(handle.curl, CURLINFO_TOTAL_TIME_T, &totalUs);
+  metrics.record(PHASE_POST, std::chrono::microseconds(totalUs));
+}
+
+bool requestFailed(UploadHandle &handle, CURLcode res) {
+  long responseCode = 0;
+  curl_easy_getinfo(handle.curl, CURLINFO_RESPONSE_CODE, &responseCode);
+  return res != CURLE_OK || responseCode / 100 == 5;
+}
+
+bool shouldRetry(UploadHandle &handle, CURLcode res, int attempts) {
+  long responseCode = 0;
+  curl_easy_getinfo(handle.curl, CURLINFO_RESPONSE_CODE, &responseCode);
+  if (responseCode / 100 != 5) {
+    LOG(LOG_WARN) << "libcurl: " << res << ", response " << responseCode
+                  << ": " << handle.errorBuffer;
+    return false;
+  }
+  if (attempts > options.maxRetries) {
+    LOG(LOG_ERROR) << "Giving up on an add-data POST after " << attempts
+                   << " attempts: response " << responseCode;
+    return false;
+  }
+  LOG(LOG_WARN) << "Add-data POST got response " << responseCode
+                << "; retrying (attempt " << attempts << " of "
+                << options.maxRetries + 1 << ")";
+  return true;
+}
+
+std::chrono::milliseconds retryDelay(int attempts) {
+  static thread_local std::mt19937_64 generator(std::random_device{}());
+  // Doubles from --retry-initial-ms with each attempt, up to --retry-max-ms,
+  // shifted no further than the cap allows so it cannot overflow
+  const int shift = std::min(attempts - 1, 30);
+  const double ceiling =
+      std::min<double>(static_cast<double>(options.retryInitialMs) *
+                           (1LL << shift),
+                       options.retryMaxMs);
+  // Half the backoff is fixed and half random, so senders that failed
+  // together do not retry together
+  const double ms =
+      ceiling / 2 +
+      std::uniform_real_distribution<double>(0, ceiling / 2)(generator);
+  return std::chrono::milliseconds(static_cast<int64_t>(ms));
+}
+
+bool getJobUri(UploadHandle &handle, std::string &jobUri) {
+  // The location header contains the URI to query for status updates for the
+  // asyncrhonous job
+  /*for (auto it = handle.headers.begin(); it != handle.headers.end(); ++it) {
+    std::cout << it->first + ": " + it->second << std::endl;
+  }*/
+  std::map<std::string, std::string>::iterator location =
+      handle.headers.find("Location");
+  if (location == handle.headers.end()) {
+    LOG(LOG_WARN) << "No Location header found in response";
+    return false;
+  }
+  jobUri = location->second;
+  return true;
+}
+
+bool postEntities(UploadHandle &handle, const char *body, size_t size,
+                  std::string &jobUri) {
+  prepareAddDataRequest(handle, body, size);
+  metrics.adjust(GAUGE_IN_FLIGHT, 1);
+
+  CURLcode res = curl_easy_perform(handle.curl);
+  recordAttempt(handle, res);
+  int attempts = 1;
+  while (requestFailed(handle, res) && shouldRetry(handle, res, attempts)) {
+    metrics.add(COUNTER_RETRIES);
+    std::this_thread::sleep_for(retryDelay(attempts));
+    // The failed attempt's response must not be taken for the next one's
+    handle.response.clear();
+    handle.headers.clear();
+    res = curl_easy_perform(handle.curl);
+    recordAttempt(handle, res);
+    ++attempts;
+  }
+  metrics.adjust(GAUGE_IN_FLIGHT, -1);
+  if (requestFailed(handle, res)) {
+    return false;
+  }
+  return getJobUri(handle, jobUri);
+}
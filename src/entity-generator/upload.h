@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include <curl/curl.h>
+
+// A libcurl easy handle configured for add-data uploads, along with the
+// buffers its callbacks write into.
+struct UploadHandle {
+  CURL *curl = NULL;
+  char errorBuffer[CURL_ERROR_SIZE];
+  std::string url;
+  std::string response;
+  std::map<std::string, std::string> headers;
+  struct curl_slist *requestHeaders = NULL;
+};
+
+size_t writefunc(void *ptr, size_t size, size_t nmemb, std::string *s);
+size_t headerfunc(void *ptr, size_t size, size_t nitems,
+                  std::map<std::string, std::string> *m);
+
+// The add-data URL for --dataset-id under --base-url
+std::string getAddDataUrl();
+// The absolute URL of the job status resource at jobUri, which is resolved
+// against --base-url unless it is already absolute
+std::string getJobUrl(const std::string &jobUri);
+
+// Creates and configures handle.curl for POSTing to the add-data endpoint.
+// Returns false if libcurl could not create the handle.
+bool initUploadHandle(UploadHandle &handle);
+void cleanupUploadHandle(UploadHandle &handle);
+
+// Points handle at the add-data endpoint with size bytes of body as the POST
+// data, and clears the response buffers.  body is not copied.
+void prepareAddDataRequest(UploadHandle &handle, const char *body,
+                           size_t size);
+
+// Counts a completed add-data attempt and records its latency in the post
+// phase, along with whether it got a 5xx or no response at all
+void recordAttempt(UploadHandle &handle, CURLcode res);
+
+// Whether a completed transfer failed: libcurl reported an error or the
+// server responded with a 5xx
+bool requestFailed(UploadHandle &handle, CURLcode res);
+
+// Logs a failed transfer that has been sent attempts times and returns true
+// if it should be retried: the server responded with a 5xx and --max-retries
+// retries have not yet been made.
+bool shouldRetry(UploadHandle &handle, CURLcode res, int attempts);
+
+// How long to wait before retrying a request sent attempts times: exponential
+// from --retry-initial-ms up to --retry-max-ms, with jitter
+std::chrono::milliseconds retryDelay(int attempts);
+
+// Reads the asynchronous job's URI from a completed add-data response.
+// Returns false, after logging, if there was no Location header.
+bool getJobUri(UploadHandle &handle, std::string &jobUri);
+
+// POSTs size bytes of body to the add-data endpoint, retrying 5xx responses
+// with backoff.  On success jobUri is set to the asynchronous job's Location;
+// returns false if the request failed for good or the response carried no
+// Location header.
+bool postEntities(UploadHandle &handle, const char *body, size_t size,
+                  std::string &jobUri);
+
+// Parses the body of a job status response.  Returns true once the job has
+// finished, setting response to the add-data call's HTTP status and result to
+// its output.
+bool parseJobStatus(const char *json, long &response, std::string &result);
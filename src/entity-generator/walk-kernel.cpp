@@ -0,0 +1,434 @@
+#include "walk-kernel.h"
+
+#include <cstdlib>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WALK_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+#include "entity.h"
+
+namespace {
+
+bool cpuSupports(WalkKernel kernel) {
+  switch (kernel) {
+  case WALK_KERNEL_SCALAR:
+    return true;
+#ifdef WALK_KERNEL_X86
+  case WALK_KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case WALK_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+void drawStreamDeltasScalar(uint64_t *state, double *dLat, double *dLng,
+                            size_t count, double min, double max) {
+  for (size_t i = 0; i < count; ++i) {
+    EntityWalk walk(state[i], min, max);
+    dLat[i] = walk();
+    dLng[i] = walk();
+  }
+}
+
+void drawPhiloxDeltasScalar(uint64_t seed, uint64_t tick, uint64_t first,
+                            double *dLat, double *dLng, size_t count,
+                            double min, double max) {
+  for (size_t i = 0; i < count; ++i) {
+    philox::walkDeltas(seed, first + i, tick, min, max, dLat[i], dLng[i]);
+  }
+}
+
+void applyWalkScalar(double *lng, double *lat, const double *dLat,
+                     const double *dLng, size_t count, bool marchWest,
+                     double stepSize) {
+  for (size_t i = 0; i < count; ++i) {
+    double newLat = lat[i] + dLat[i];
+    double newLng = lng[i] + dLng[i];
+    if (marchWest) {
+      newLng = lng[i] - stepSize;
+    }
+
+    if (lng[i] > -180 && newLng < -180) {
+      newLng += 360;
+    } else if (lng[i] < 180 and newLng > 180) {
+      newLng -= 360;
+    }
+    if (lat[i] > -90 && newLat < -90) {
+      newLat += 180;
+    } else if (lat[i] < 90 and newLat > 90) {
+      newLat -= 180;
+    }
+
+    lng[i] = newLng;
+    lat[i] = newLat;
+  }
+}
+
+#ifdef WALK_KERNEL_X86
+
+// splitmix64 constants; see EntityWalk
+const uint64_t GOLDEN_GAMMA = 0x9E3779B97F4A7C15ULL;
+const uint64_t MIX_1 = 0xBF58476D1CE4E5B9ULL;
+const uint64_t MIX_2 = 0x94D049BB133111EBULL;
+// Or-ing a 32-bit integer into the mantissa of 2^52 gives 2^52 + n exactly
+const uint64_t TWO_52_BITS = 0x4330000000000000ULL;
+
+__attribute__((target("sse2"))) __m128i mul64(__m128i a, __m128i b) {
+  __m128i low = _mm_mul_epu32(a, b);
+  __m128i cross = _mm_add_epi64(_mm_mul_epu32(a, _mm_srli_epi64(b, 32)),
+                                _mm_mul_epu32(_mm_srli_epi64(a, 32), b));
+  return _mm_add_epi64(low, _mm_slli_epi64(cross, 32));
+}
+
+// Converts the top 53 bits of each lane to a double in [0, 1), exactly as
+// EntityWalk does
+__attribute__((target("sse2"))) __m128d toUnit(__m128i z) {
+  const __m128i bits = _mm_set1_epi64x(TWO_52_BITS);
+  const __m128d two52 = _mm_set1_pd(4503599627370496.0);
+  __m128i x = _mm_srli_epi64(z, 11);
+  __m128i lo = _mm_and_si128(x, _mm_set1_epi64x(0xFFFFFFFFULL));
+  __m128i hi = _mm_srli_epi64(x, 32);
+  __m128d loD = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(lo, bits)), two52);
+  __m128d hiD = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(hi, bits)), two52);
+  __m128d value = _mm_add_pd(_mm_mul_pd(hiD, _mm_set1_pd(4294967296.0)), loD);
+  return _mm_mul_pd(value, _mm_set1_pd(1.0 / 9007199254740992.0));
+}
+
+__attribute__((target("sse2"))) __m128d drawSse2(__m128i &state, __m128d min,
+                                                 __m128d range) {
+  state = _mm_add_epi64(state, _mm_set1_epi64x(GOLDEN_GAMMA));
+  __m128i z = state;
+  z = mul64(_mm_xor_si128(z, _mm_srli_epi64(z, 30)), _mm_set1_epi64x(MIX_1));
+  z = mul64(_mm_xor_si128(z, _mm_srli_epi64(z, 27)), _mm_set1_epi64x(MIX_2));
+  z = _mm_xor_si128(z, _mm_srli_epi64(z, 31));
+  return _mm_add_pd(min, _mm_mul_pd(range, toUnit(z)));
+}
+
+__attribute__((target("sse2"))) void
+drawStreamDeltasSse2(uint64_t *state, double *dLat, double *dLng, size_t count,
+                     double min, double max) {
+  const __m128d minV = _mm_set1_pd(min);
+  const __m128d rangeV = _mm_set1_pd(max - min);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<__m128i *>(state + i));
+    _mm_storeu_pd(dLat + i, drawSse2(s, minV, rangeV));
+    _mm_storeu_pd(dLng + i, drawSse2(s, minV, rangeV));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + i), s);
+  }
+  drawStreamDeltasScalar(state + i, dLat + i, dLng + i, count - i, min, max);
+}
+
+// One Philox4x32-10 block per lane.  Each 32-bit word of the counter sits in
+// the low half of a 64-bit lane, where _mm_mul_epu32 gives the full product.
+__attribute__((target("sse2"))) void
+drawPhiloxDeltasSse2(uint64_t seed, uint64_t tick, uint64_t first,
+                     double *dLat, double *dLng, size_t count, double min,
+                     double max) {
+  const __m128i low = _mm_set1_epi64x(0xFFFFFFFFULL);
+  const __m128i m0 = _mm_set1_epi64x(philox::M0);
+  const __m128i m1 = _mm_set1_epi64x(philox::M1);
+  const __m128d minV = _mm_set1_pd(min);
+  const __m128d rangeV = _mm_set1_pd(max - min);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    uint64_t entity = first + i;
+    __m128i c0 = _mm_set_epi64x((entity + 1) & 0xFFFFFFFFULL,
+                                entity & 0xFFFFFFFFULL);
+    __m128i c1 = _mm_set_epi64x((entity + 1) >> 32, entity >> 32);
+    __m128i c2 = _mm_set1_epi64x(tick & 0xFFFFFFFFULL);
+    __m128i c3 = _mm_set1_epi64x(tick >> 32);
+    uint32_t k0 = static_cast<uint32_t>(seed);
+    uint32_t k1 = static_cast<uint32_t>(seed >> 32);
+    for (int round = 0; round < philox::ROUNDS; ++round) {
+      __m128i p0 = _mm_mul_epu32(c0, m0);
+      __m128i p1 = _mm_mul_epu32(c2, m1);
+      c0 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi64(p1, 32), c1),
+                         _mm_set1_epi64x(k0));
+      c2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi64(p0, 32), c3),
+                         _mm_set1_epi64x(k1));
+      c1 = _mm_and_si128(p1, low);
+      c3 = _mm_and_si128(p0, low);
+      k0 += philox::W0;
+      k1 += philox::W1;
+    }
+    __m128d lat = toUnit(_mm_or_si128(_mm_slli_epi64(c0, 32), c1));
+    __m128d lng = toUnit(_mm_or_si128(_mm_slli_epi64(c2, 32), c3));
+    _mm_storeu_pd(dLat + i, _mm_add_pd(minV, _mm_mul_pd(rangeV, lat)));
+    _mm_storeu_pd(dLng + i, _mm_add_pd(minV, _mm_mul_pd(rangeV, lng)));
+  }
+  drawPhiloxDeltasScalar(seed, tick, first + i, dLat + i, dLng + i, count - i,
+                         min, max);
+}
+
+__attribute__((target("sse2"))) __m128d select(__m128d mask, __m128d a,
+                                               __m128d b) {
+  return _mm_or_pd(_mm_and_pd(mask, b), _mm_andnot_pd(mask, a));
+}
+
+// Branch-free form of the scalar wrap: add span where the old value was above
+// -limit and the new one is below it, subtract it where the old value was
+// below limit and the new one is above it.  Selecting rather than adding zero
+// keeps the sign of a -0.0 result.
+__attribute__((target("sse2"))) __m128d wrapSse2(__m128d old, __m128d next,
+                                                 double limit, double span) {
+  const __m128d lower = _mm_set1_pd(-limit);
+  const __m128d upper = _mm_set1_pd(limit);
+  const __m128d spanV = _mm_set1_pd(span);
+  __m128d under =
+      _mm_and_pd(_mm_cmpgt_pd(old, lower), _mm_cmplt_pd(next, lower));
+  __m128d over = _mm_andnot_pd(
+      under, _mm_and_pd(_mm_cmplt_pd(old, upper), _mm_cmpgt_pd(next, upper)));
+  next = select(under, next, _mm_add_pd(next, spanV));
+  return select(over, next, _mm_sub_pd(next, spanV));
+}
+
+__attribute__((target("sse2"))) void
+applyWalkSse2(double *lng, double *lat, const double *dLat, const double *dLng,
+              size_t count, bool marchWest, double stepSize) {
+  const __m128d step = _mm_set1_pd(stepSize);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d lngV = _mm_loadu_pd(lng + i);
+    __m128d latV = _mm_loadu_pd(lat + i);
+    __m128d newLat = _mm_add_pd(latV, _mm_loadu_pd(dLat + i));
+    __m128d newLng = marchWest ? _mm_sub_pd(lngV, step)
+                               : _mm_add_pd(lngV, _mm_loadu_pd(dLng + i));
+    _mm_storeu_pd(lng + i, wrapSse2(lngV, newLng, 180, 360));
+    _mm_storeu_pd(lat + i, wrapSse2(latV, newLat, 90, 180));
+  }
+  applyWalkScalar(lng + i, lat + i, dLat + i, dLng + i, count - i, marchWest,
+                  stepSize);
+}
+
+__attribute__((target("avx2"))) __m256i mul64(__m256i a, __m256i b) {
+  __m256i low = _mm256_mul_epu32(a, b);
+  __m256i cross =
+      _mm256_add_epi64(_mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)),
+                       _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b));
+  return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) __m256d toUnit(__m256i z) {
+  const __m256i bits = _mm256_set1_epi64x(TWO_52_BITS);
+  const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+  __m256i x = _mm256_srli_epi64(z, 11);
+  __m256i lo = _mm256_and_si256(x, _mm256_set1_epi64x(0xFFFFFFFFULL));
+  __m256i hi = _mm256_srli_epi64(x, 32);
+  __m256d loD =
+      _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(lo, bits)), two52);
+  __m256d hiD =
+      _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(hi, bits)), two52);
+  __m256d value =
+      _mm256_add_pd(_mm256_mul_pd(hiD, _mm256_set1_pd(4294967296.0)), loD);
+  return _mm256_mul_pd(value, _mm256_set1_pd(1.0 / 9007199254740992.0));
+}
+
+__attribute__((target("avx2"))) __m256d drawAvx2(__m256i &state, __m256d min,
+                                                 __m256d range) {
+  state = _mm256_add_epi64(state, _mm256_set1_epi64x(GOLDEN_GAMMA));
+  __m256i z = state;
+  z = mul64(_mm256_xor_si256(z, _mm256_srli_epi64(z, 30)),
+            _mm256_set1_epi64x(MIX_1));
+  z = mul64(_mm256_xor_si256(z, _mm256_srli_epi64(z, 27)),
+            _mm256_set1_epi64x(MIX_2));
+  z = _mm256_xor_si256(z, _mm256_srli_epi64(z, 31));
+  return _mm256_add_pd(min, _mm256_mul_pd(range, toUnit(z)));
+}
+
+__attribute__((target("avx2"))) void
+drawStreamDeltasAvx2(uint64_t *state, double *dLat, double *dLng, size_t count,
+                     double min, double max) {
+  const __m256d minV = _mm256_set1_pd(min);
+  const __m256d rangeV = _mm256_set1_pd(max - min);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<__m256i *>(state + i));
+    _mm256_storeu_pd(dLat + i, drawAvx2(s, minV, rangeV));
+    _mm256_storeu_pd(dLng + i, drawAvx2(s, minV, rangeV));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state + i), s);
+  }
+  drawStreamDeltasScalar(state + i, dLat + i, dLng + i, count - i, min, max);
+}
+
+__attribute__((target("avx2"))) void
+drawPhiloxDeltasAvx2(uint64_t seed, uint64_t tick, uint64_t first,
+                     double *dLat, double *dLng, size_t count, double min,
+                     double max) {
+  const __m256i low = _mm256_set1_epi64x(0xFFFFFFFFULL);
+  const __m256i m0 = _mm256_set1_epi64x(philox::M0);
+  const __m256i m1 = _mm256_set1_epi64x(philox::M1);
+  const __m256i lanes = _mm256_set_epi64x(3, 2, 1, 0);
+  const __m256d minV = _mm256_set1_pd(min);
+  const __m256d rangeV = _mm256_set1_pd(max - min);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i entity = _mm256_add_epi64(_mm256_set1_epi64x(first + i), lanes);
+    __m256i c0 = _mm256_and_si256(entity, low);
+    __m256i c1 = _mm256_srli_epi64(entity, 32);
+    __m256i c2 = _mm256_set1_epi64x(tick & 0xFFFFFFFFULL);
+    __m256i c3 = _mm256_set1_epi64x(tick >> 32);
+    uint32_t k0 = static_cast<uint32_t>(seed);
+    uint32_t k1 = static_cast<uint32_t>(seed >> 32);
+    for (int round = 0; round < philox::ROUNDS; ++round) {
+      __m256i p0 = _mm256_mul_epu32(c0, m0);
+      __m256i p1 = _mm256_mul_epu32(c2, m1);
+      c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1),
+                            _mm256_set1_epi64x(k0));
+      c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3),
+                            _mm256_set1_epi64x(k1));
+      c1 = _mm256_and_si256(p1, low);
+      c3 = _mm256_and_si256(p0, low);
+      k0 += philox::W0;
+      k1 += philox::W1;
+    }
+    __m256d lat = toUnit(_mm256_or_si256(_mm256_slli_epi64(c0, 32), c1));
+    __m256d lng = toUnit(_mm256_or_si256(_mm256_slli_epi64(c2, 32), c3));
+    _mm256_storeu_pd(dLat + i,
+                     _mm256_add_pd(minV, _mm256_mul_pd(rangeV, lat)));
+    _mm256_storeu_pd(dLng + i,
+                     _mm256_add_pd(minV, _mm256_mul_pd(rangeV, lng)));
+  }
+  drawPhiloxDeltasScalar(seed, tick, first + i, dLat + i, dLng + i, count - i,
+                         min, max);
+}
+
+__attribute__((target("avx2"))) __m256d wrapAvx2(__m256d old, __m256d next,
+                                                 double limit, double span) {
+  const __m256d lower = _mm256_set1_pd(-limit);
+  const __m256d upper = _mm256_set1_pd(limit);
+  const __m256d spanV = _mm256_set1_pd(span);
+  __m256d under = _mm256_and_pd(_mm256_cmp_pd(old, lower, _CMP_GT_OQ),
+                                _mm256_cmp_pd(next, lower, _CMP_LT_OQ));
+  __m256d over = _mm256_andnot_pd(
+      under, _mm256_and_pd(_mm256_cmp_pd(old, upper, _CMP_LT_OQ),
+                           _mm256_cmp_pd(next, upper, _CMP_GT_OQ)));
+  next = _mm256_blendv_pd(next, _mm256_add_pd(next, spanV), under);
+  return _mm256_blendv_pd(next, _mm256_sub_pd(next, spanV), over);
+}
+
+__attribute__((target("avx2"))) void
+applyWalkAvx2(double *lng, double *lat, const double *dLat, const double *dLng,
+              size_t count, bool marchWest, double stepSize) {
+  const __m256d step = _mm256_set1_pd(stepSize);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d lngV = _mm256_loadu_pd(lng + i);
+    __m256d latV = _mm256_loadu_pd(lat + i);
+    __m256d newLat = _mm256_add_pd(latV, _mm256_loadu_pd(dLat + i));
+    __m256d newLng =
+        marchWest ? _mm256_sub_pd(lngV, step)
+                  : _mm256_add_pd(lngV, _mm256_loadu_pd(dLng + i));
+    _mm256_storeu_pd(lng + i, wrapAvx2(lngV, newLng, 180, 360));
+    _mm256_storeu_pd(lat + i, wrapAvx2(latV, newLat, 90, 180));
+  }
+  applyWalkScalar(lng + i, lat + i, dLat + i, dLng + i, count - i, marchWest,
+                  stepSize);
+}
+
+#endif
+
+} // namespace
+
+bool parseWalkKernel(const std::string &name, WalkKernel &kernel) {
+  if (name == "auto") {
+    kernel = WALK_KERNEL_SCALAR;
+    if (cpuSupports(WALK_KERNEL_SSE2)) {
+      kernel = WALK_KERNEL_SSE2;
+    }
+    if (cpuSupports(WALK_KERNEL_AVX2)) {
+      kernel = WALK_KERNEL_AVX2;
+    }
+    return true;
+  }
+  if (name == "scalar") {
+    kernel = WALK_KERNEL_SCALAR;
+  } else if (name == "sse2") {
+    kernel = WALK_KERNEL_SSE2;
+  } else if (name == "avx2") {
+    kernel = WALK_KERNEL_AVX2;
+  } else {
+    return false;
+  }
+  return cpuSupports(kernel);
+}
+
+const char *walkKernelName(WalkKernel kernel) {
+  switch (kernel) {
+  case WALK_KERNEL_SSE2:
+    return "sse2";
+  case WALK_KERNEL_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+WalkKernel walkKernel() {
+  static WalkKernel kernel = WALK_KERNEL_SCALAR;
+  static std::string resolved;
+  if (resolved != options.simd) {
+    if (!parseWalkKernel(options.simd, kernel)) {
+      std::cerr << "Unsupported --simd kernel: " << options.simd << std::endl;
+      exit(1);
+    }
+    resolved = options.simd;
+  }
+  return kernel;
+}
+
+void drawStreamDeltas(WalkKernel kernel, uint64_t *state, double *dLat,
+                      double *dLng, size_t count, double min, double max) {
+  switch (kernel) {
+#ifdef WALK_KERNEL_X86
+  case WALK_KERNEL_AVX2:
+    drawStreamDeltasAvx2(state, dLat, dLng, count, min, max);
+    break;
+  case WALK_KERNEL_SSE2:
+    drawStreamDeltasSse2(state, dLat, dLng, count, min, max);
+    break;
+#endif
+  default:
+    drawStreamDeltasScalar(state, dLat, dLng, count, min, max);
+  }
+}
+
+void drawPhiloxDeltas(WalkKernel kernel, uint64_t seed, uint64_t tick,
+                      uint64_t first, double *dLat, double *dLng, size_t count,
+                      double min, double max) {
+  switch (kernel) {
+#ifdef WALK_KERNEL_X86
+  case WALK_KERNEL_AVX2:
+    drawPhiloxDeltasAvx2(seed, tick, first, dLat, dLng, count, min, max);
+    break;
+  case WALK_KERNEL_SSE2:
+    drawPhiloxDeltasSse2(seed, tick, first, dLat, dLng, count, min, max);
+    break;
+#endif
+  default:
+    drawPhiloxDeltasScalar(seed, tick, first, dLat, dLng, count, min, max);
+  }
+}
+
+void applyWalk(WalkKernel kernel, double *lng, double *lat, const double *dLat,
+               const double *dLng, size_t count, bool marchWest,
+               double stepSize) {
+  switch (kernel) {
+#ifdef WALK_KERNEL_X86
+  case WALK_KERNEL_AVX2:
+    applyWalkAvx2(lng, lat, dLat, dLng, count, marchWest, stepSize);
+    break;
+  case WALK_KERNEL_SSE2:
+    applyWalkSse2(lng, lat, dLat, dLng, count, marchWest, stepSize);
+    break;
+#endif
+  default:
+    applyWalkScalar(lng, lat, dLat, dLng, count, marchWest, stepSize);
+  }
+}
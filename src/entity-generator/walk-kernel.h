@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Implementations of the random walk's inner loops.  The vector kernels
+// perform the same IEEE operations in the same order as the scalar one, so
+// every kernel produces bit-identical positions.
+enum WalkKernel {
+  WALK_KERNEL_SCALAR,
+  WALK_KERNEL_SSE2,
+  WALK_KERNEL_AVX2,
+};
+
+// The kernel named by --simd: scalar, sse2, avx2, or auto for the widest one
+// this CPU supports.  Returns false for an unknown or unsupported name.
+bool parseWalkKernel(const std::string &name, WalkKernel &kernel);
+const char *walkKernelName(WalkKernel kernel);
+
+// The kernel selected by --simd, resolved on first use
+WalkKernel walkKernel();
+
+// Draws count latitude and longitude deltas, uniform in [min, max), from the
+// per-entity splitmix64 streams in state (see EntityWalk), advancing each
+// stream by two draws.
+void drawStreamDeltas(WalkKernel kernel, uint64_t *state, double *dLat,
+                      double *dLng, size_t count, double min, double max);
+
+// Draws the --rng=philox latitude and longitude deltas at tick for the count
+// entities starting at index first.
+void drawPhiloxDeltas(WalkKernel kernel, uint64_t seed, uint64_t tick,
+                      uint64_t first, double *dLat, double *dLng, size_t count,
+                      double min, double max);
+
+// Moves count entities by the provided deltas and wraps them back across the
+// antimeridian and the poles.  With marchWest the longitude deltas are
+// ignored and every entity moves stepSize west instead.
+void applyWalk(WalkKernel kernel, double *lng, double *lat, const double *dLat,
+               const double *dLng, size_t count, bool marchWest,
+               double stepSize);
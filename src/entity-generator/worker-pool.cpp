@@ -0,0 +1,83 @@
+#include "worker-pool.h"
+
+namespace {
+
+void partition(size_t count, size_t parts, size_t index, size_t &begin,
+               size_t &end) {
+  begin = count * index / parts;
+  end = count * (index + 1) / parts;
+}
+
+} // namespace
+
+WorkerPool::WorkerPool(int threads)
+    : task_(NULL), count_(0), generation_(0), pending_(0), stopping_(false) {
+  for (int i = 1; i < threads; ++i) {
+    workers_.push_back(std::thread(&WorkerPool::work, this, i));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i].join();
+  }
+}
+
+void WorkerPool::run(size_t count, const Task &task) {
+  size_t parts = size();
+  if (parts == 1) {
+    task(0, count);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    count_ = count;
+    pending_ = workers_.size();
+    ++generation_;
+  }
+  start_.notify_all();
+
+  size_t begin, end;
+  partition(count, parts, 0, begin, end);
+  task(begin, end);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return pending_ == 0; });
+  task_ = NULL;
+}
+
+void WorkerPool::work(size_t index) {
+  unsigned long seen = 0;
+  while (true) {
+    const Task *task;
+    size_t count;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [this, seen] {
+        return stopping_ || generation_ != seen;
+      });
+      if (stopping_) {
+        return;
+      }
+      seen = generation_;
+      task = task_;
+      count = count_;
+    }
+
+    size_t begin, end;
+    partition(count, size(), index, begin, end);
+    (*task)(begin, end);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
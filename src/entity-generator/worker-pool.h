@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that split a range of work between them.  The
+// threads live as long as the pool, so per-tick work does not pay for thread
+// creation.
+class WorkerPool {
+public:
+  typedef std::function<void(size_t begin, size_t end)> Task;
+
+  explicit WorkerPool(int threads);
+  ~WorkerPool();
+
+  int size() const { return static_cast<int>(workers_.size()) + 1; }
+
+  // Splits [0, count) into one contiguous partition per thread and calls task
+  // on each; the calling thread takes the first partition.  Returns once
+  // every partition is done.
+  void run(size_t count, const Task &task);
+
+private:
+  void work(size_t index);
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const Task *task_;
+  size_t count_;
+  unsigned long generation_;
+  size_t pending_;
+  bool stopping_;
+};